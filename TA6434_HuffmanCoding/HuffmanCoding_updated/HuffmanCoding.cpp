@@ -22,18 +22,274 @@
 #include <sstream>
 #include <algorithm>
 #include <map>
+#include <unordered_map>
+#include <vector>
 #include <queue>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <climits> // CHAR_BIT
-#include <unistd.h> // getopt
+#include <cstdlib> // posix_memalign
+#include <unistd.h> // getopt, pread
+#include <fcntl.h> // open, O_DIRECT, posix_fadvise
+#include <sys/uio.h> // writev
+#include <cstring> // memcpy
 #include <ctime>
 
-const int NUM_CHARS = (1 << CHAR_BIT) + 1; // Max number of character values: 256 bytes + FAKE_EOF
-const int FAKE_EOF = NUM_CHARS - 1; // Special value to mark end of file (256)
-
 using namespace std;
 
-typedef map<int, string> HuffCodeMap; // Maps characters to their associated codes (bitstrings)
-typedef map<int, size_t> FreqMap; // Maps characters to their associated frequencies
+template <typename Symbol> using HuffCodeMap = map<Symbol, string>; // Maps symbols to their associated codes (bitstrings)
+template <typename Symbol> using FreqMap = map<Symbol, size_t>; // Maps symbols to their associated frequencies
+
+//
+// Symbol alphabets
+// An alphabet splits the input into symbols, turns symbols back into bytes
+// and names them in the file header. Symbols are unsigned integers and
+// FAKE_EOF marks the end of the data.
+//
+
+// Fixed-width alphabet of BITS-bit little-endian samples (8 or 16 bits).
+// A trailing odd byte of a 16-bit input is coded with one of the tail symbols.
+template <unsigned int BITS>
+class FixedAlphabet
+{
+public:
+    typedef unsigned int Symbol;
+    static const size_t WIDTH = BITS / CHAR_BIT; // Bytes per sample
+    static const Symbol TAIL = (WIDTH > 1) ? (1 << CHAR_BIT) : 0; // Number of tail symbols
+    static const Symbol NUM_SYMBOLS = (1 << BITS) + TAIL + 1; // Max number of symbol values: samples + tail bytes + FAKE_EOF
+    static const Symbol FAKE_EOF = NUM_SYMBOLS - 1; // Special value to mark end of file (256 for bytes)
+    static const bool SPARSE = (BITS > CHAR_BIT); // Count a large alphabet in a sparse histogram
+
+    static string Tag() { return BITS == CHAR_BIT ? "" : ToTag(); }
+    size_t MaxSymbols() const { return NUM_SYMBOLS; }
+
+    // Read the symbol starting at in[pos], return the position after it
+    size_t Next(const unsigned char* in, size_t size, size_t pos, Symbol& sym) const
+    {
+        if (pos + WIDTH > size) { // Trailing odd byte
+            sym = (1 << BITS) + in[pos];
+            return(pos + 1);
+        }
+        sym = 0;
+        for (size_t i = 0; i < WIDTH; i++) {
+            sym |= static_cast<Symbol>(in[pos + i]) << (i * CHAR_BIT);
+        }
+        return(pos + WIDTH);
+    }
+
+    // Length of the prefix of in[] that splits into whole symbols when
+    // more data follows
+    size_t Boundary(const unsigned char*, size_t size) const { return(size - size % WIDTH); }
+
+    // Store the bytes of a symbol at out, return the position after them
+    char* Emit(Symbol sym, char* out) const
+    {
+        if (sym >= (1u << BITS)) {
+            *out++ = static_cast<char>(sym - (1 << BITS));
+            return(out);
+        }
+        for (size_t i = 0; i < WIDTH; i++) {
+            *out++ = static_cast<char>(sym >> (i * CHAR_BIT));
+        }
+        return(out);
+    }
+
+    // Max number of bytes a symbol emits
+    size_t MaxEmit() const { return(WIDTH); }
+
+    // Printable name of a symbol
+    string Name(Symbol sym) const
+    {
+        if (sym == FAKE_EOF) {
+            return("EOF");
+        }
+        ostringstream os;
+        if (WIDTH > 1 || isprint(sym)) {
+            if (WIDTH > 1) {
+                os << sym;
+            } else {
+                os << static_cast<char>(sym);
+            }
+            return(os.str());
+        }
+        switch (sym) { // Print some white-space characters
+        case 0  : return("'\\0'");
+        case 9  : return("'\\t'");
+        case 10 : return("'\\n'");
+        case 13 : return("'\\r'");
+        case 20 : return("' '");
+        default : os << sym; // Print the character in decimal
+        }
+        return(os.str());
+    }
+
+    // Fixed symbols need nothing besides their value in the header
+    void WriteExtra(Symbol, string&) const {}
+    bool ReadExtra(Symbol, istream&, size_t) { return(true); }
+
+private:
+    static string ToTag()
+    {
+        ostringstream os;
+        os << BITS;
+        return(os.str());
+    }
+};
+
+template <unsigned int BITS> const typename FixedAlphabet<BITS>::Symbol FixedAlphabet<BITS>::FAKE_EOF;
+
+typedef FixedAlphabet<CHAR_BIT> ByteAlphabet;
+typedef FixedAlphabet<2 * CHAR_BIT> WideAlphabet;
+
+// Word-level alphabet: a run of word bytes (letters, digits and non-ASCII
+// UTF-8 bytes) is one token, every other byte is a token of its own.
+// Single bytes keep their byte value, FAKE_EOF is 256 and longer words get
+// ids from 257 upwards, which are spelled out in the file header.
+class WordAlphabet
+{
+public:
+    typedef unsigned int Symbol;
+    static const Symbol FAKE_EOF = 1 << CHAR_BIT;
+    static const bool SPARSE = false; // Word ids are handed out densely
+
+    WordAlphabet() : m_maxWord(1) {}
+
+    static string Tag() { return("w"); }
+    size_t MaxSymbols() const { return(UINT_MAX); }
+
+    size_t Next(const unsigned char* in, size_t size, size_t pos, Symbol& sym)
+    {
+        size_t end = pos;
+        while (end < size && IsWordByte(in[end])) {
+            end++;
+        }
+        if (end - pos < 2) {
+            sym = in[pos];
+            return(pos + 1);
+        }
+
+        string word(reinterpret_cast<const char*>(in + pos), end - pos);
+        unordered_map<string, Symbol>::const_iterator it = m_ids.find(word);
+        if (it != m_ids.end()) {
+            sym = it->second;
+        } else {
+            sym = FAKE_EOF + 1 + m_words.size();
+            m_ids[word] = sym;
+            m_words.push_back(word);
+        }
+        return(end);
+    }
+
+    // A word running into the end of the data may continue after it
+    size_t Boundary(const unsigned char* in, size_t size) const
+    {
+        while (size > 0 && IsWordByte(in[size - 1])) {
+            size--;
+        }
+        return(size);
+    }
+
+    char* Emit(Symbol sym, char* out) const
+    {
+        if (sym < FAKE_EOF) {
+            *out++ = static_cast<char>(sym);
+        } else if (sym > FAKE_EOF) {
+            const string& word = m_words[sym - FAKE_EOF - 1];
+            memcpy(out, word.data(), word.size());
+            out += word.size();
+        }
+        return(out);
+    }
+
+    size_t MaxEmit() const { return(m_maxWord); }
+
+    string Name(Symbol sym) const
+    {
+        return(sym > FAKE_EOF ? m_words[sym - FAKE_EOF - 1] : ByteAlphabet().Name(sym));
+    }
+
+    // Words carry their spelling after the code
+    void WriteExtra(Symbol sym, string& table) const
+    {
+        if (sym > FAKE_EOF) {
+            table += ' ';
+            table += m_words[sym - FAKE_EOF - 1];
+        }
+    }
+
+    // Word ids are dense, so a table of the given number of entries
+    // holds no id past that many above FAKE_EOF
+    bool ReadExtra(Symbol sym, istream& is, size_t entries)
+    {
+        if (sym <= FAKE_EOF) {
+            return(true);
+        }
+        string word;
+        size_t index = sym - FAKE_EOF - 1;
+        if (index >= entries || !(is >> word)) {
+            return(false);
+        }
+        if (index >= m_words.size()) {
+            m_words.resize(index + 1);
+        }
+        m_words[index] = word;
+        m_maxWord = max(m_maxWord, word.size());
+        return(true);
+    }
+
+private:
+    vector<string> m_words; // Spelling of word ids above FAKE_EOF
+    unordered_map<string, Symbol> m_ids; // Word id of each spelling
+    size_t m_maxWord; // Length of the longest word read from the header
+
+    static bool IsWordByte(unsigned char c) { return(isalnum(c) || c >= 0x80); }
+};
+
+const WordAlphabet::Symbol WordAlphabet::FAKE_EOF;
+
+// Symbol histogram. Small alphabets count into a dense array, large ones
+// into a hash table touching only the symbols that occur.
+template <class Alphabet, bool SPARSE = Alphabet::SPARSE>
+class Histogram
+{
+public:
+    typedef typename Alphabet::Symbol Symbol;
+    Histogram() : m_counts(Alphabet::FAKE_EOF + 1, 0) {}
+    void Add(Symbol sym)
+    {
+        if (sym >= m_counts.size()) {
+            m_counts.resize(sym + 1, 0);
+        }
+        m_counts[sym]++;
+    }
+    // Collect the symbols that occur
+    void Get(FreqMap<Symbol>& freqs) const
+    {
+        for (size_t i = 0; i < m_counts.size(); i++) {
+            if (m_counts[i]) {
+                freqs[static_cast<Symbol>(i)] = m_counts[i];
+            }
+        }
+    }
+private:
+    vector<size_t> m_counts;
+};
+
+template <class Alphabet>
+class Histogram<Alphabet, true>
+{
+public:
+    typedef typename Alphabet::Symbol Symbol;
+    void Add(Symbol sym) { m_counts[sym]++; }
+    void Get(FreqMap<Symbol>& freqs) const
+    {
+        freqs.insert(m_counts.begin(), m_counts.end()); // Sorted, so both sides build the same tree
+    }
+private:
+    unordered_map<Symbol, size_t> m_counts;
+};
 
 // Huffman node base class
 class HuffNode
@@ -61,12 +317,13 @@ public:
 };
 
 // Leaf node subclass
+template <typename Symbol>
 class LeafNode : public HuffNode
 {
 public:
-    const int ch; // Character (in decimal value)
-    LeafNode(size_t freq, int ch) : HuffNode(freq), ch(ch) {}
-    LeafNode(int ch) : HuffNode(0), ch(ch) {}
+    const Symbol ch; // Symbol (in decimal value)
+    LeafNode(size_t freq, Symbol ch) : HuffNode(freq), ch(ch) {}
+    LeafNode(Symbol ch) : HuffNode(0), ch(ch) {}
 };
 
 // Comparator for HuffNode
@@ -78,12 +335,13 @@ struct Compare
 };
 
 // Build Huffman encoding tree from a collection of frequencies
-HuffNode* BuildTree(FreqMap& freqs)
+template <typename Symbol>
+HuffNode* BuildTree(FreqMap<Symbol>& freqs)
 {
     priority_queue<HuffNode*, vector<HuffNode*>, Compare> trees;
 
-    for(FreqMap::const_iterator it = freqs.begin(); it != freqs.end(); it++) {
-        trees.push(new LeafNode(it->second, it->first)); // The queue is sorted automatically as new entries are added.
+    for(typename FreqMap<Symbol>::const_iterator it = freqs.begin(); it != freqs.end(); it++) {
+        trees.push(new LeafNode<Symbol>(it->second, it->first)); // The queue is sorted automatically as new entries are added.
     }
 
     HuffNode *tmp1, *tmp2;
@@ -99,9 +357,10 @@ HuffNode* BuildTree(FreqMap& freqs)
 }
 
 // Build code table
-void BuildCode(const HuffNode* node, const string& prefix, HuffCodeMap& outCodes)
+template <typename Symbol>
+void BuildCode(const HuffNode* node, const string& prefix, HuffCodeMap<Symbol>& outCodes)
 {
-    if (const LeafNode* lf = dynamic_cast<const LeafNode*>(node)) {
+    if (const LeafNode<Symbol>* lf = dynamic_cast<const LeafNode<Symbol>*>(node)) {
         outCodes[lf->ch] = prefix;
     } else if (const InternalNode* in = dynamic_cast<const InternalNode*>(node)) {
         // Append 0 to code so far and traverse left
@@ -115,78 +374,73 @@ void BuildCode(const HuffNode* node, const string& prefix, HuffCodeMap& outCodes
     }
 }
 
-// Helper for RebuildTree
-void Traverse(HuffNode* node, int& index, string const& traversal) {
-    InternalNode* in = dynamic_cast<InternalNode*>(node);
-
-    if (traversal[index+1] == 'L') { // This is the marker of the last bit of the code
-        char ch = traversal[index+2]; // Get the stored character
-        int val;
-        if (ch == '2' && traversal[index+3] == '5' && traversal[index+4] == '6') {
-            val = FAKE_EOF;
-        } else {
-            val = (int) ch;
+// Rebuild Huffman tree from code table that was used to compress the file.
+// Returns NULL if the codes do not form a complete prefix code: every
+// internal node must have both children, or the decoder could walk off
+// the tree.
+template <typename Symbol>
+HuffNode* RebuildTree(HuffCodeMap<Symbol> &outCodes)
+{
+    InternalNode* root = new InternalNode();
+    for (typename HuffCodeMap<Symbol>::const_iterator it = outCodes.begin(); it != outCodes.end(); ++it){
+        const string& code = it->second;
+        InternalNode* in = root;
+        for (size_t i = 0; in && i < code.size(); i++) {
+            HuffNode*& child = (code[i] == '1') ? in->right : in->left;
+            if (i + 1 == code.size()) { // This is the last bit of the code
+                if (child != NULL) {
+                    in = NULL;
+                    break;
+                }
+                child = new LeafNode<Symbol>(it->first);
+            } else {
+                if (child == NULL){
+                    child = new InternalNode();
+                }
+                in = dynamic_cast<InternalNode*>(child);
+            }
         }
-
-        if (traversal[index-1+1] == '0') {
-            in->left = new LeafNode(val);
-        } else if (traversal[index-1+1] == '1') {
-            in->right = new LeafNode(val);
+        if (!in || code.empty()) {
+            delete root;
+            return(NULL);
         }
-        return;
     }
 
-    if (traversal[index] == '1') {
-        if (in->right == NULL){
-            in->right = new InternalNode();
-        }
-        Traverse(in->right, ++index, traversal);
-
-    } else if (traversal[index] == '0') {
-        if (in->left == NULL){
-            in->left = new InternalNode();
+    // Check the children without recursion, as crafted codes may be long
+    vector<const InternalNode*> pending(1, root);
+    while (!pending.empty()) {
+        const InternalNode* in = pending.back();
+        pending.pop_back();
+        if (!in->left || !in->right) {
+            delete root;
+            return(NULL);
         }
-        Traverse(in->left, ++index, traversal);
-    }
-}
-
-// Rebuild Huffman tree from code table that was used to compress the file
-HuffNode* RebuildTree(HuffCodeMap &outCodes)
-{
-    int index;
-    string traversal;
-    HuffNode* root = new InternalNode();
-    for (HuffCodeMap::const_iterator it = outCodes.begin(); it != outCodes.end(); ++it){
-        index = 0;
-        traversal = it->second + "L"; // Append marker L for leaf node
-        if (it->first == FAKE_EOF) {
-            stringstream ss;
-            ss << it->first;
-            traversal += ss.str();
-        } else {
-            traversal += static_cast<char>(it->first);
+        const HuffNode* children[2] = { in->left, in->right };
+        for (int c = 0; c < 2; c++) {
+            if (const InternalNode* child = dynamic_cast<const InternalNode*>(children[c])) {
+                pending.push_back(child);
+            }
         }
-        // String traversal now should contain: code + marker L + character
-        Traverse(root, index, traversal);
     }
     return(root);
 }
 
 // Display pre-order traversal
+template <typename Symbol>
 void DisplayTraversal(HuffNode* node) {
     if (!node) {
         return;
     }
 
-    if (LeafNode* lf = dynamic_cast<LeafNode*>(node)) {
+    if (LeafNode<Symbol>* lf = dynamic_cast<LeafNode<Symbol>*>(node)) {
         cout << "\tLeaf Node (" << lf->ch << ")" << endl;
         return;
     }
 
     InternalNode* in = dynamic_cast<InternalNode*>(node);
     cout << "Internal Node " << endl;
-    DisplayTraversal(in->left);
-    DisplayTraversal(in->right);
+    DisplayTraversal<Symbol>(in->left);
+    DisplayTraversal<Symbol>(in->right);
 }
 
 // Convert value to string
@@ -198,56 +452,517 @@ string ToStr(const T& t) {
 }
 
 // Display character, frequency and code for each character
-void Display(HuffCodeMap& outCodes, FreqMap& freqs){
+template <class Alphabet>
+void Display(const Alphabet& alphabet, HuffCodeMap<typename Alphabet::Symbol>& outCodes, FreqMap<typename Alphabet::Symbol>& freqs){
+    typedef typename Alphabet::Symbol Symbol;
     string s1 = "Char  ", s2 = "Frequency         ", s3 = "Code", s4 = s1 + s2 + s3;
     cout << endl << setfill('-') << setw(s4.size()) << "-" << endl;
     cout << s4 << endl;
     cout << setfill('-') << setw(s4.size()) << "-" << setfill(' ') << endl;
 
-    for (HuffCodeMap::const_iterator it = outCodes.begin(); it != outCodes.end(); ++it) {
-        cout << setw(s1.size()) << left;
-        if (!isprint(it->first)) {
-            switch (it->first) { // Print some white-space characters
-            case 0  : cout << "'\\0'"; break;
-            case 9  : cout << "'\\t'"; break;
-            case 10 : cout << "'\\n'"; break;
-            case 13 : cout << "'\\r'"; break;
-            case 20 : cout << "' '"; break;
-            case FAKE_EOF: cout << "EOF"; break;
-            default : cout << it->first; // Print the character in decimal
-            }
-        } else {
-            cout << static_cast<char>(it->first);
-        }
+    for (typename HuffCodeMap<Symbol>::const_iterator it = outCodes.begin(); it != outCodes.end(); ++it) {
+        cout << setw(s1.size()) << left << alphabet.Name(it->first);
         cout << setw(s2.size()) << left << freqs[it->first];
         cout << left << it->second;
         cout << endl;
     }
 }
 
+// Reads the compressed data bit by bit, most significant bit first.
+// Reading past the end yields zero bits.
+class BitReader
+{
+public:
+    BitReader(const unsigned char* data, size_t size) : m_data(data), m_size(size), m_pos(0), m_bits(0), m_bitCount(0) {}
+
+    // Look at the next n (n <= 32) bits without consuming them
+    unsigned int Peek(unsigned int n)
+    {
+        while (m_bitCount < n) {
+            m_bits = (m_bits << CHAR_BIT) | (m_pos < m_size ? m_data[m_pos] : 0);
+            m_pos++;
+            m_bitCount += CHAR_BIT;
+        }
+        return(static_cast<unsigned int>(m_bits >> (m_bitCount - n)) & ((1u << n) - 1));
+    }
+    void Skip(unsigned int n) { m_bitCount -= n; }
+    int ReadBit(void)
+    {
+        int bit = Peek(1);
+        Skip(1);
+        return(bit);
+    }
+    // True once all the data has been consumed
+    bool Exhausted() const { return(m_pos * CHAR_BIT - m_bitCount >= m_size * CHAR_BIT); }
+
+private:
+    const unsigned char* m_data;
+    size_t m_size, m_pos;
+    unsigned long long m_bits; // Buffered bits not yet consumed
+    unsigned int m_bitCount; // Number of bits buffered
+};
+
+// Packs code bits into bytes
+class BitWriter
+{
+public:
+    BitWriter() : m_bits(0), m_bitCount(0) {}
+
+    // Write the given bit encoding to temporary buffer
+    void Write(const string& encoding, string& buf)
+    {
+        for (string::const_iterator it = encoding.begin(); it != encoding.end(); ++it) {
+            m_bits = 2*m_bits + *it - '0'; // Push bits on from the right
+            m_bitCount++;
+
+            if (m_bitCount == CHAR_BIT) {
+                buf.push_back(m_bits);
+                m_bits = 0;
+                m_bitCount = 0;
+            }
+        }
+    }
+
+private:
+    unsigned int m_bits, m_bitCount; // Buffers holding raw bits and number of bits filled
+};
+
+// Table driven decoder. Hot symbols, whose codes are at most LOOKUP_BITS
+// long, resolve with a single lookup in a dense table; the rare longer
+// codes continue the walk down the tree from where the table left off.
+template <typename Symbol>
+class DecodeTable
+{
+public:
+    static const unsigned int LOOKUP_BITS = 10;
+
+    DecodeTable(const HuffNode* root) : m_table(1 << LOOKUP_BITS)
+    {
+        for (unsigned int i = 0; i < m_table.size(); i++) {
+            const HuffNode* node = root;
+            unsigned int len = 0;
+            while (len < LOOKUP_BITS) {
+                const InternalNode* in = dynamic_cast<const InternalNode*>(node);
+                if (!in) {
+                    break;
+                }
+                node = ((i >> (LOOKUP_BITS - 1 - len)) & 1) ? in->right : in->left;
+                len++;
+            }
+            Entry& e = m_table[i];
+            e.len = len;
+            if (const LeafNode<Symbol>* lf = dynamic_cast<const LeafNode<Symbol>*>(node)) {
+                e.node = NULL;
+                e.sym = lf->ch;
+            } else {
+                e.node = node;
+                e.sym = 0;
+            }
+        }
+    }
+
+    // Decode the next symbol
+    Symbol Decode(BitReader& bits) const
+    {
+        const Entry& e = m_table[bits.Peek(LOOKUP_BITS)];
+        bits.Skip(e.len);
+        if (!e.node) {
+            return(e.sym);
+        }
+        const HuffNode* node = e.node;
+        while (const InternalNode* in = dynamic_cast<const InternalNode*>(node)) {
+            bits.ReadBit() ? node = in->right : node = in->left;
+        }
+        return(static_cast<const LeafNode<Symbol>*>(node)->ch);
+    }
+
+private:
+    struct Entry {
+        const HuffNode* node; // Subtree to continue from, NULL if sym is final
+        Symbol sym;
+        unsigned int len; // Number of bits consumed by the lookup
+    };
+    vector<Entry> m_table;
+};
+
+//
+// Compression pipeline
+// Three stages overlap: a reader thread streams the input ahead of the
+// main thread, which counts (first pass) or encodes (second pass) the
+// symbols, while a writer thread drains the encoded blocks. The input is
+// read with O_DIRECT into aligned blocks so cold multi-GB files neither
+// stall the coder nor flood the page cache.
+//
+
+// Blocking queue handing buffers from one pipeline stage to the next
+template <typename T>
+class BlockQueue
+{
+public:
+    void Push(T item)
+    {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_items.push_back(item);
+        }
+        m_ready.notify_one();
+    }
+    T Pop()
+    {
+        unique_lock<mutex> lock(m_mutex);
+        while (m_items.empty()) {
+            m_ready.wait(lock);
+        }
+        T item = m_items.front();
+        m_items.pop_front();
+        return(item);
+    }
+private:
+    deque<T> m_items;
+    mutex m_mutex;
+    condition_variable m_ready;
+};
+
+// Aligned block of input data
+struct Block
+{
+    unsigned char* data;
+    size_t size; // Bytes filled
+    bool last; // Last block of the file
+};
+
+// Reads a file on a background thread into a ring of NUM_BLOCKS blocks,
+// so up to NUM_BLOCKS - 1 blocks are read ahead of the consumer.
+class BlockReader
+{
+public:
+    static const size_t BLOCK_SIZE = 1 << 20; // Multiple of the O_DIRECT alignment
+    static const size_t ALIGNMENT = 4096;
+    static const size_t NUM_BLOCKS = 3; // Triple buffering
+
+    BlockReader(const string& fileName, size_t fileSize) : m_fileSize(fileSize), m_failed(false), m_done(false)
+    {
+        m_fd = open(fileName.c_str(), O_RDONLY | O_DIRECT);
+        if (m_fd < 0) { // Not every file system supports direct I/O
+            m_fd = open(fileName.c_str(), O_RDONLY);
+            if (m_fd >= 0) {
+                posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            }
+        }
+        for (size_t i = 0; i < NUM_BLOCKS; i++) {
+            void* p = NULL;
+            if (posix_memalign(&p, ALIGNMENT, BLOCK_SIZE) != 0) {
+                cerr << "ERROR: Out of memory" << endl;
+                exit(1);
+            }
+            m_blocks[i].data = static_cast<unsigned char*>(p);
+            m_free.Push(&m_blocks[i]);
+        }
+        if (m_fd < 0) {
+            m_failed = true;
+            m_full.Push(NULL);
+        } else {
+            m_thread = thread(&BlockReader::Run, this);
+        }
+    }
+
+    ~BlockReader()
+    {
+        // Drain the reader so it can run to the end of the file
+        while (!m_done) {
+            Release(Next());
+        }
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+        for (size_t i = 0; i < NUM_BLOCKS; i++) {
+            free(m_blocks[i].data);
+        }
+    }
+
+    // Return the next block of the file, NULL past the last block
+    Block* Next()
+    {
+        if (m_done) {
+            return(NULL);
+        }
+        Block* b = m_full.Pop();
+        if (!b || b->last) {
+            m_done = true;
+        }
+        return(b);
+    }
+
+    // Hand a consumed block back to the reader
+    void Release(Block* b)
+    {
+        if (b) {
+            m_free.Push(b);
+        }
+    }
+
+    bool Failed() const { return(m_failed); }
+
+private:
+    void Run()
+    {
+        size_t offset = 0;
+        for (;;) {
+            Block* b = m_free.Pop();
+            b->size = 0;
+            while (b->size < BLOCK_SIZE && offset < m_fileSize) {
+                ssize_t n = pread(m_fd, b->data + b->size, BLOCK_SIZE - b->size, offset);
+                if (n < 0) {
+                    int error = errno;
+                    if (error == EINTR) {
+                        continue;
+                    }
+                    int flags = fcntl(m_fd, F_GETFL);
+                    if (error == EINVAL && flags >= 0 && (flags & O_DIRECT)
+                            && fcntl(m_fd, F_SETFL, flags & ~O_DIRECT) == 0) {
+                        // Opened for O_DIRECT but refused its reads, say
+                        // for another block size: go on buffered
+                        continue;
+                    }
+                    m_failed = true;
+                    break;
+                } else if (n == 0) {
+                    break;
+                }
+                b->size += n;
+                offset += n;
+                if (offset % ALIGNMENT != 0 && offset < m_fileSize) {
+                    // Cut short partway: O_DIRECT cannot go on from an
+                    // unaligned offset, so the rest is read buffered
+                    fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT);
+                }
+            }
+            b->last = m_failed || b->size < BLOCK_SIZE || offset >= m_fileSize;
+            m_full.Push(b);
+            if (b->last) {
+                return;
+            }
+        }
+    }
+
+    int m_fd;
+    size_t m_fileSize;
+    bool m_failed;
+    bool m_done;
+    Block m_blocks[NUM_BLOCKS];
+    BlockQueue<Block*> m_free, m_full;
+    thread m_thread;
+};
+
+// Writes encoded blocks to a stream on a background thread
+class BlockWriter
+{
+public:
+    static const size_t NUM_BLOCKS = 3;
+
+    BlockWriter(fstream& out) : m_out(out), m_failed(false)
+    {
+        for (size_t i = 0; i < NUM_BLOCKS; i++) {
+            m_free.Push(&m_bufs[i]);
+        }
+        m_thread = thread(&BlockWriter::Run, this);
+    }
+
+    ~BlockWriter() { Finish(); }
+
+    // Queue the contents of buf for writing; buf gets back an empty buffer
+    void Write(string& buf)
+    {
+        string* s = m_free.Pop();
+        s->swap(buf);
+        buf.clear();
+        m_full.Push(s);
+    }
+
+    // Wait for all queued blocks to be written
+    bool Finish()
+    {
+        if (m_thread.joinable()) {
+            m_full.Push(NULL);
+            m_thread.join();
+        }
+        return(!m_failed);
+    }
+
+private:
+    void Run()
+    {
+        while (string* s = m_full.Pop()) {
+            m_out.write(s->data(), s->size());
+            if (m_out.fail()) {
+                m_failed = true;
+            }
+            s->clear();
+            m_free.Push(s);
+        }
+    }
+
+    fstream& m_out;
+    bool m_failed;
+    string m_bufs[NUM_BLOCKS];
+    BlockQueue<string*> m_free, m_full;
+    thread m_thread;
+};
+
+// Feed every symbol of the file to the stage, block by block. A symbol
+// running into the end of a block is carried over into the next one.
+template <class Alphabet, class Stage>
+bool ScanBlocks(BlockReader& reader, Alphabet& alphabet, Stage& stage)
+{
+    typename Alphabet::Symbol sym;
+    string carry, joined;
+    while (Block* b = reader.Next()) {
+        const unsigned char* in = b->data;
+        size_t size = b->size;
+        if (!carry.empty()) {
+            joined.swap(carry);
+            joined.append(reinterpret_cast<const char*>(b->data), b->size);
+            in = reinterpret_cast<const unsigned char*>(joined.data());
+            size = joined.size();
+        }
+
+        size_t end = b->last ? size : alphabet.Boundary(in, size);
+        for (size_t k = 0; k < end; ) {
+            k = alphabet.Next(in, end, k, sym);
+            stage.Add(sym);
+        }
+        carry.assign(reinterpret_cast<const char*>(in) + end, size - end);
+        joined.clear();
+
+        reader.Release(b);
+        stage.EndBlock();
+    }
+    return(!reader.Failed());
+}
+
+// First pass: count the symbols
+template <class Alphabet>
+class CountStage
+{
+public:
+    CountStage(Histogram<Alphabet>& hist) : m_hist(hist) {}
+    void Add(typename Alphabet::Symbol sym) { m_hist.Add(sym); }
+    void EndBlock() {}
+private:
+    Histogram<Alphabet>& m_hist;
+};
+
+// Second pass: encode the symbols and pass each block on to the writer
+template <class Alphabet>
+class EncodeStage
+{
+public:
+    typedef typename Alphabet::Symbol Symbol;
+    EncodeStage(HuffCodeMap<Symbol>& codes, BlockWriter& writer) : m_codes(codes), m_writer(writer) {}
+    void Add(Symbol sym) { m_bits.Write(m_codes[sym], m_buf); }
+    void EndBlock() { m_writer.Write(m_buf); }
+
+    // Write the encoding for FAKE_EOF and flush the last bits
+    void Finish()
+    {
+        m_bits.Write(m_codes[Alphabet::FAKE_EOF], m_buf);
+        m_bits.Write("0000000", m_buf); // Write an extra 8 blank bits to flush the output buffer
+        m_writer.Write(m_buf);
+    }
+
+private:
+    HuffCodeMap<Symbol>& m_codes;
+    BlockWriter& m_writer;
+    BitWriter m_bits;
+    string m_buf;
+};
+
+// Writes finished chunks of the decoded output, gathering up to
+// MAX_CHUNKS of them into one writev call. The chunks must stay valid
+// until Flush.
+class ChunkWriter
+{
+public:
+    static const size_t CHUNK_SIZE = 1 << 18;
+    static const size_t MAX_CHUNKS = 16;
+
+    ChunkWriter(int fd) : m_fd(fd), m_failed(false) {}
+
+    void Add(const char* data, size_t size)
+    {
+        if (size == 0) {
+            return;
+        }
+        iovec v;
+        v.iov_base = const_cast<char*>(data);
+        v.iov_len = size;
+        m_iov.push_back(v);
+        if (m_iov.size() == MAX_CHUNKS) {
+            Flush();
+        }
+    }
+
+    bool Flush()
+    {
+        size_t i = 0;
+        while (i < m_iov.size() && !m_failed) {
+            ssize_t n = writev(m_fd, &m_iov[i], m_iov.size() - i);
+            if (n < 0) {
+                if (errno != EINTR) {
+                    m_failed = true;
+                }
+                continue;
+            }
+            // Skip past what was written
+            while (n > 0) {
+                if (static_cast<size_t>(n) >= m_iov[i].iov_len) {
+                    n -= m_iov[i].iov_len;
+                    i++;
+                } else {
+                    m_iov[i].iov_base = static_cast<char*>(m_iov[i].iov_base) + n;
+                    m_iov[i].iov_len -= n;
+                    n = 0;
+                }
+            }
+        }
+        m_iov.clear();
+        return(!m_failed);
+    }
+
+private:
+    int m_fd;
+    bool m_failed;
+    vector<iovec> m_iov;
+};
+
+const size_t ChunkWriter::CHUNK_SIZE;
+
 // Test class
 class Test
 {
 public:
-    Test(string const& filename, string const& filename2, bool decompress, bool genTable, bool useTable, bool force, bool useFreq, bool verbose);
+    Test(string const& filename, string const& filename2, bool decompress, bool genTable, bool useTable, bool force, bool useFreq, bool verbose, string const& alphabet);
     ~Test ();
     int Compress(void);
     int Decompress(void);
 
 private:
-    unsigned int m_bits, m_bitCount; // Buffers holding raw bits and number of bits filled
     size_t m_originalSize, m_originalSize2, m_ofileSize; // For a file with a size under 2GB we could use int but lets use size_t
-    string m_fileName, m_fileName2, m_ofileName, m_ofileName2;
+    size_t m_headerSize; // Original size recorded in the header
+    bool m_hasSize; // Header records the original size (older files do not)
+    string m_fileName, m_fileName2, m_ofileName, m_ofileName2, m_alphabet;
     fstream m_file, m_file2, m_ofile, m_ofile2;
     bool m_decompress, m_genTable, m_useTable, m_force, m_useFreq, m_verbose;
-    void WriteBits(string& encoding, string& buf);
-    int ReadBit(void);
-    void Decode(const HuffNode* node, int& ch);
-    void ReadTable(fstream& fs, FreqMap& freqs, HuffCodeMap& codes);
+    template <class Alphabet> int Compress(Alphabet& alphabet);
+    template <class Alphabet> int Decompress(Alphabet& alphabet);
+    template <class Alphabet> void ReadTable(fstream& fs, Alphabet& alphabet, FreqMap<typename Alphabet::Symbol>& freqs, HuffCodeMap<typename Alphabet::Symbol>& codes);
 };
 
 // Constructor
-Test::Test(string const& fileName, string const& fileName2, bool decompress, bool genTable, bool useTable, bool force, bool useFreq, bool verbose) : m_bits(0), m_bitCount(0)
+Test::Test(string const& fileName, string const& fileName2, bool decompress, bool genTable, bool useTable, bool force, bool useFreq, bool verbose, string const& alphabet)
 {
     m_fileName = fileName;
     m_decompress = decompress;
@@ -256,6 +971,7 @@ Test::Test(string const& fileName, string const& fileName2, bool decompress, boo
     m_force = force;
     m_useFreq = useFreq;
     m_verbose = verbose;
+    m_alphabet = alphabet;
     string ext = "z";
 
     if (m_decompress) {
@@ -331,54 +1047,20 @@ Test::~Test ()
     }
 }
 
-// Write the given bit encoding to temporary buffer
-void Test::WriteBits(string& encoding, string& buf)
-{
-    for (string::const_iterator it = encoding.begin(); it != encoding.end(); ++it) {
-        m_bits = 2*m_bits + *it - '0'; // Push bits on from the right
-        m_bitCount++;
-
-        if (m_bitCount == CHAR_BIT) {
-            buf.push_back(m_bits);
-            m_bits = 0;
-            m_bitCount = 0;
-        }
-    }
-}
-
-// Read a single bit from the input file
-int Test::ReadBit(void)
-{
-    unsigned int nextBit;
-    if (m_bitCount == 0) {
-        m_bits = m_file.get();
-        m_bitCount = (1 << (CHAR_BIT - 1));
-    }
-
-    nextBit = m_bits / m_bitCount;
-    m_bits %= m_bitCount;
-    m_bitCount /= 2;
-
-    return(nextBit);
-}
-
-// Decode
-void Test::Decode(const HuffNode* node, int& ch) {
-    while (const InternalNode* in = dynamic_cast<const InternalNode*>(node)) {
-        ReadBit() ? node = in->right : node = in->left;
-    }
-    ch = dynamic_cast<const LeafNode*>(node)->ch;
-}
-
 //
 // Read table
 // FILE STRUCTURE:
-// [Total characters]\n
-// [Character (in decimal)] [Frequency/Code]\n
+// [@Alphabet tag]\n (only for alphabets other than bytes)
+// [=Original size]\n (absent in files from older versions)
+// [Total symbols]\n
+// [Symbol (in decimal)] [Frequency/Code] [Word (word alphabet only)]\n
 // [Data]FAKE_EOF
 //
-void Test::ReadTable(fstream& fs, FreqMap& freqs, HuffCodeMap& codes){ //TODO: sanity check for code?
-    int totalChars, startPos;
+template <class Alphabet>
+void Test::ReadTable(fstream& fs, Alphabet& alphabet, FreqMap<typename Alphabet::Symbol>& freqs, HuffCodeMap<typename Alphabet::Symbol>& codes){
+    typedef typename Alphabet::Symbol Symbol;
+    size_t totalChars;
+    int startPos;
     int err = 0;
     string line;
 
@@ -388,7 +1070,7 @@ void Test::ReadTable(fstream& fs, FreqMap& freqs, HuffCodeMap& codes){ //TODO: s
         exit(1);
     }
 
-    if (totalChars > NUM_CHARS) {
+    if (totalChars > alphabet.MaxSymbols()) {
         err = 2;
         cerr << "ERROR: Malformed file header (" << err << ")" << endl;
         exit(1);
@@ -400,13 +1082,13 @@ void Test::ReadTable(fstream& fs, FreqMap& freqs, HuffCodeMap& codes){ //TODO: s
 
     fs.seekg(startPos); // Put the get pointer to the position startPos
 
-    for(int i = 0; i < totalChars; i++) {
+    for(size_t i = 0; i < totalChars; i++) {
         getline(fs, line);
-        int a;
+        Symbol a;
         string b;
 
         istringstream iss(line);
-        if (!(iss >> a >> b)) {
+        if (!(iss >> a >> b) || !alphabet.ReadExtra(a, iss, totalChars)) {
             err = 3;
             cerr << "ERROR: Malformed file header (" << err << ")" << endl;
             exit(1);
@@ -426,13 +1108,13 @@ void Test::ReadTable(fstream& fs, FreqMap& freqs, HuffCodeMap& codes){ //TODO: s
         }
     }
     if (m_useFreq){
-        if (freqs.find(FAKE_EOF) == freqs.end()) {
+        if (freqs.find(Alphabet::FAKE_EOF) == freqs.end()) {
             err = 5;
             cerr << "ERROR: Malformed file header (" << err << ")" << endl;
             exit(1);
         }
     } else {
-        if (codes.find(FAKE_EOF) == codes.end()) {
+        if (codes.find(Alphabet::FAKE_EOF) == codes.end()) {
             err = 5;
             cerr << "ERROR: Malformed file header (" << err << ")" << endl;
             exit(1);
@@ -443,10 +1125,49 @@ void Test::ReadTable(fstream& fs, FreqMap& freqs, HuffCodeMap& codes){ //TODO: s
 // Decompress
 int Test::Decompress(void)
 {
-    FreqMap freqs;
-    HuffCodeMap codes;
+    // The alphabet tag, if any, leads the table
+    fstream& fs = m_useTable ? m_file2 : m_file;
+    string tag;
+    if (fs.peek() == '@') {
+        getline(fs, tag);
+        tag.erase(0, 1);
+    }
 
-    m_useTable ? ReadTable(m_file2, freqs, codes) : ReadTable(m_file, freqs, codes);
+    // So does the original size
+    m_hasSize = false;
+    if (fs.peek() == '=') {
+        string line;
+        getline(fs, line);
+        istringstream iss(line.substr(1));
+        if (!(iss >> m_headerSize)) {
+            cerr << "ERROR: Malformed file header (7)" << endl;
+            exit(1);
+        }
+        m_hasSize = true;
+    }
+
+    if (tag == ByteAlphabet::Tag()) {
+        ByteAlphabet alphabet;
+        return(Decompress(alphabet));
+    } else if (tag == WideAlphabet::Tag()) {
+        WideAlphabet alphabet;
+        return(Decompress(alphabet));
+    } else if (tag == WordAlphabet::Tag()) {
+        WordAlphabet alphabet;
+        return(Decompress(alphabet));
+    }
+    cerr << "ERROR: Unknown alphabet \"" << tag << "\"" << endl;
+    exit(1);
+}
+
+template <class Alphabet>
+int Test::Decompress(Alphabet& alphabet)
+{
+    typedef typename Alphabet::Symbol Symbol;
+    FreqMap<Symbol> freqs;
+    HuffCodeMap<Symbol> codes;
+
+    m_useTable ? ReadTable(m_file2, alphabet, freqs, codes) : ReadTable(m_file, alphabet, freqs, codes);
 
     int startPos;
     startPos = m_file.tellg(); // Tell the current position of get stream pointer so far
@@ -460,15 +1181,105 @@ int Test::Decompress(void)
     } else {
         root = RebuildTree(codes);
     }
+    if (!dynamic_cast<InternalNode*>(root)) {
+        cerr << "ERROR: Malformed file header (6)" << endl;
+        exit(1);
+    }
+
+    // Load the encoded data
+    vector<unsigned char> data(m_originalSize - startPos);
+    if (!data.empty()) {
+        m_file.read((char*)&data[0], data.size());
+        data.resize(m_file.gcount());
+    }
+
+    // Every code is at least one bit, so the data cannot decode to more
+    // than this; a larger size in the header is not to be allocated
+    if (m_hasSize && m_headerSize > 8 * data.size() * alphabet.MaxEmit()) {
+        cerr << "ERROR: Malformed file header (8)" << endl;
+        exit(1);
+    }
+
+    // Decode into a temporary file, renamed to the output only once the
+    // whole file decoded, so no failure leaves a partial output behind
+    string partName = m_ofileName + ".part";
+    int fd = open(partName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        cerr << "ERROR: Cannot open output file \"" << partName << "\"" << endl;
+        exit(1);
+    }
 
-    string buf;
-    int ch;
-    while (m_file.good()) {
-        Decode(root, ch);
-        if (ch == FAKE_EOF){
-            break;
+    DecodeTable<Symbol> table(root);
+    BitReader bits(data.empty() ? NULL : &data[0], data.size());
+    ChunkWriter writer(fd);
+    vector<char> buf;
+    char* out;
+    Symbol ch = 0;
+    bool sizeMismatch = false;
+
+    if (m_hasSize) {
+        // Decode straight into one buffer of the original size; the slack
+        // only catches a symbol overrunning it in a corrupted file. Each
+        // finished chunk goes out while the next one is decoded.
+        buf.resize(m_headerSize + alphabet.MaxEmit());
+        out = &buf[0];
+        char* end = out + m_headerSize;
+        while (out < end) {
+            char* chunk = out;
+            char* chunkEnd = out + min(ChunkWriter::CHUNK_SIZE, static_cast<size_t>(end - out));
+            while (out < chunkEnd) {
+                ch = table.Decode(bits);
+                if (ch == Alphabet::FAKE_EOF){
+                    break;
+                }
+                out = alphabet.Emit(ch, out);
+            }
+            writer.Add(chunk, min(out, end) - chunk);
+            if (ch == Alphabet::FAKE_EOF){
+                break;
+            }
+        }
+        if (ch != Alphabet::FAKE_EOF) {
+            ch = table.Decode(bits);
+        }
+        sizeMismatch = (out != end || ch != Alphabet::FAKE_EOF);
+        m_ofileSize = min(out, end) - &buf[0];
+    } else {
+        // Older files: grow the buffer as we go
+        size_t used = 0;
+        buf.resize(ChunkWriter::CHUNK_SIZE);
+        while (!bits.Exhausted()) {
+            ch = table.Decode(bits);
+            if (ch == Alphabet::FAKE_EOF){
+                break;
+            }
+            if (buf.size() - used < alphabet.MaxEmit()) {
+                buf.resize(2 * buf.size() + alphabet.MaxEmit());
+            }
+            used = alphabet.Emit(ch, &buf[used]) - &buf[0];
         }
-        buf.push_back(static_cast<char>(ch));
+        writer.Add(&buf[0], used);
+        m_ofileSize = used;
+    }
+
+    bool written = writer.Flush();
+    if (close(fd) != 0) {
+        written = false;
+    }
+    if (!written) {
+        unlink(partName.c_str());
+        cerr << "ERROR: Cannot write output file \"" << partName << "\"" << endl;
+        exit(1);
+    }
+    if (sizeMismatch) {
+        unlink(partName.c_str());
+        cerr << "ERROR: Decoded data does not match the original size " << m_headerSize << endl;
+        exit(1);
+    }
+    if (rename(partName.c_str(), m_ofileName.c_str()) != 0) {
+        unlink(partName.c_str());
+        cerr << "ERROR: Cannot write output file \"" << m_ofileName << "\"" << endl;
+        exit(1);
     }
 
     size_t tableSize;
@@ -477,7 +1288,6 @@ int Test::Decompress(void)
     else {
        tableSize = (size_t) startPos;
     }
-    m_ofileSize = buf.size();
 
     if (m_verbose) {
         cout << endl
@@ -487,15 +1297,6 @@ int Test::Decompress(void)
         << endl;
     }
 
-    m_ofile.open(m_ofileName.c_str(), ios::out | ios::ate | ios::binary);
-    if (m_ofile.fail()) {
-        cerr << "ERROR: Cannot open output file \"" << m_ofileName << "\"" << endl;
-        exit(1);
-    }
-
-    m_ofile << buf;
-    m_ofile.close();
-
     delete root;
     return(0);
 }
@@ -503,37 +1304,59 @@ int Test::Decompress(void)
 // Compress
 int Test::Compress(void)
 {
-    unsigned char* in = new unsigned char[m_originalSize];
-
-    m_file.read((char*)in, m_originalSize);
-    if (!m_file) {
-        cerr << "ERROR: Only " << m_file.gcount() << " could be read." << endl;
-        exit(1);
+    if (m_alphabet == "8") {
+        ByteAlphabet alphabet;
+        return(Compress(alphabet));
+    } else if (m_alphabet == "16") {
+        WideAlphabet alphabet;
+        return(Compress(alphabet));
     }
+    WordAlphabet alphabet;
+    return(Compress(alphabet));
+}
 
-    FreqMap freqs;
-    HuffCodeMap codes;
+template <class Alphabet>
+int Test::Compress(Alphabet& alphabet)
+{
+    typedef typename Alphabet::Symbol Symbol;
+    FreqMap<Symbol> freqs;
+    HuffCodeMap<Symbol> codes;
 
     // Build frequency table
-    for(unsigned int k = 0; k < m_originalSize; ++k) {
-        freqs[static_cast<unsigned char>(in[k])]++;
+    Histogram<Alphabet> hist;
+    {
+        BlockReader reader(m_fileName, m_originalSize);
+        CountStage<Alphabet> count(hist);
+        if (!ScanBlocks(reader, alphabet, count)) {
+            cerr << "ERROR: Cannot read input file \"" << m_fileName << "\"" << endl;
+            exit(1);
+        }
     }
+    hist.Get(freqs);
 
-    freqs[FAKE_EOF] = 1; // Add FAKE_EOF
+    freqs[Alphabet::FAKE_EOF] = 1; // Add FAKE_EOF
     HuffNode* root = BuildTree(freqs);
     BuildCode(root, string(), codes);
-    //DisplayTraversal(root);
+    //DisplayTraversal<Symbol>(root);
     delete root;
 
     if (m_verbose) {
-        Display(codes, freqs);
+        Display(alphabet, codes, freqs);
     }
 
     // Write file header needed for the decompression process
     string table;
+    if (!Alphabet::Tag().empty()) {
+        table+='@';
+        table+=Alphabet::Tag(); // Write the alphabet tag
+        table+='\n';
+    }
+    table+='=';
+    table+=ToStr(m_originalSize); // Write the original size
+    table+='\n';
     table+=ToStr(codes.size()); // Write total unique characters
     table+='\n';
-    for (HuffCodeMap::const_iterator it = codes.begin(); it != codes.end(); ++it) {
+    for (typename HuffCodeMap<Symbol>::const_iterator it = codes.begin(); it != codes.end(); ++it) {
         table+=ToStr(it->first); // Write the character
         table+=' ';
         if (m_useFreq) {
@@ -541,34 +1364,21 @@ int Test::Compress(void)
         } else {
             table+=it->second; // Write code
         }
+        alphabet.WriteExtra(it->first, table);
         table+='\n';
     }
 
-    // Read the input a second time. For each character read,
-    // write the encoding of the character (obtained from the
-    // map of encodings) to the compressed file.
+    // The encoded size follows from the frequencies, so it is known
+    // before the second pass. The data ends with FAKE_EOF and 7 blank
+    // bits flushing the last byte.
     size_t encodedBits = 0;
-    string code, buf;
-    for(unsigned int k = 0; k < m_originalSize; ++k) {
-        code = codes[static_cast<unsigned char>(in[k])];
-        encodedBits+=code.size();
-        WriteBits(code, buf);
+    for (typename HuffCodeMap<Symbol>::const_iterator it = codes.begin(); it != codes.end(); ++it) {
+        encodedBits+=freqs[it->first] * it->second.size();
     }
-    delete[] in;
-
-    // Write the encoding for FAKE_EOF
-    code = codes[FAKE_EOF];
-    encodedBits+=code.size();
-    WriteBits(code, buf);
-
-    // Write an extra 8 blank bits to flush the output buffer
-    code = "0000000";
-    //encodedBits+=code.size();
-    WriteBits(code, buf);
 
     // Calculate some stats
     size_t tableSize = table.size();
-    size_t encodedSize = buf.size();
+    size_t encodedSize = (encodedBits + CHAR_BIT - 1) / CHAR_BIT;
     size_t total = tableSize + encodedSize;
     size_t originalBits = 8 * sizeof(char) * m_originalSize;
 
@@ -615,7 +1425,23 @@ int Test::Compress(void)
     // Now do actual writing
     m_genTable?m_ofile2 << table : m_ofile << table;
 
-    m_ofile << buf;
+    // Read the input a second time. For each character read,
+    // write the encoding of the character (obtained from the
+    // map of encodings) to the compressed file.
+    {
+        BlockReader reader(m_fileName, m_originalSize);
+        BlockWriter writer(m_ofile);
+        EncodeStage<Alphabet> encode(codes, writer);
+        if (!ScanBlocks(reader, alphabet, encode)) {
+            cerr << "ERROR: Cannot read input file \"" << m_fileName << "\"" << endl;
+            exit(1);
+        }
+        encode.Finish();
+        if (!writer.Finish()) {
+            cerr << "ERROR: Cannot write output file \"" << m_ofileName << "\"" << endl;
+            exit(1);
+        }
+    }
     m_ofile.close();
 
     if (m_genTable) {
@@ -639,6 +1465,8 @@ void printUsage(const string name){
     << "  -f    Force\n"
     << "  -1    Use Character-frequency table in header (default:\n"
     << "        use character-code table).\n"
+    << "  -a <ALPHABET>    Symbol alphabet for compression: 8 (bytes,\n"
+    << "        default), 16 (16-bit samples) or w (word tokens)\n"
     << "  -h    Print this help\n"
     << "  -v    Verbose mode\n"
     << "\n"
@@ -650,11 +1478,11 @@ int main(int argc, char* argv[])
 {
     clock_t start = clock();
     int op;
-    int dflag = 0, gflag = 0, tflag = 0, fflag = 0, oflag = 0, vflag = 0;
-    string fileName, fileName2;
+    int dflag = 0, gflag = 0, tflag = 0, fflag = 0, oflag = 0, vflag = 0, aflag = 0;
+    string fileName, fileName2, alphabet = "8";
 
     // Read the parameters
-    while ((op = getopt(argc, argv, "hdgf1vt:")) != -1) {
+    while ((op = getopt(argc, argv, "hdgf1vt:a:")) != -1) {
         switch (op) {
         case 'h': printUsage(argv[0]); exit(0);
         case 'd': dflag++; break;
@@ -663,6 +1491,7 @@ int main(int argc, char* argv[])
         case 'f': fflag++; break;
         case '1': oflag++; break;
         case 'v': vflag++; break;
+        case 'a': alphabet = optarg; aflag++; break;
         default : goto usage;
         }
     }
@@ -686,6 +1515,14 @@ int main(int argc, char* argv[])
         }
     }
 
+    if (alphabet != "8" && alphabet != "16" && alphabet != "w") {
+        cerr << argv[0] << ": Unknown alphabet \"" << alphabet << "\"" << endl;
+        goto usage;
+    } else if (aflag && dflag) {
+        cerr << argv[0] << ": Cannot use option -a with -d or -t" << endl;
+        goto usage;
+    }
+
     if ( argc != 1 && (fileName.empty()) ) {
         cerr << argv[0] << ": No input file specified" << endl;
 usage:
@@ -702,10 +1539,11 @@ usage:
         << "Gen table flag: "<< gflag << "\n"
         << "Input table flag: "<< tflag << ", input table: "<< fileName2 << "\n"
         << "Force flag: "<< fflag << "\n"
-        << "Use character-frequency flag: "<< oflag << endl;
+        << "Use character-frequency flag: "<< oflag << "\n"
+        << "Alphabet: "<< alphabet << endl;
     }
 
-    Test test(fileName, fileName2, dflag, gflag, tflag, fflag, oflag, vflag);
+    Test test(fileName, fileName2, dflag, gflag, tflag, fflag, oflag, vflag, alphabet);
 
     !dflag ? test.Compress() : test.Decompress();
 
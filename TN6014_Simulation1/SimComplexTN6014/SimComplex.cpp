@@ -46,17 +46,29 @@
 #include <string>
 #include <vector>
 #include <queue> //priority_queue
+#include <algorithm> //upper_bound, partial_sort
 #include <cmath> //log, sqrt, cos, sin
-#include <cstdlib> //random, srandom
+#include <cstdlib> //EXIT_SUCCESS
+#include <stdint.h> //uint64_t
 #include <ctime> //time
 #include <unistd.h> //getopt
 #include <sstream> //istringstream
-
-//XXX
-#if defined(_WIN32) || defined(_WIN64)
-    #define random rand
-    #define srandom srand
-#endif
+#include <deque> //deque
+#include <cctype> //isalnum
+#include <thread> //thread, hardware_concurrency
+#include <atomic> //atomic
+#include <mutex> //mutex, unique_lock
+#include <condition_variable> //condition_variable
+#include <chrono> //steady_clock
+#include <new> //bad_alloc
+#include <getopt.h> //getopt_long
+#include <type_traits> //is_trivially_copyable
+#include <cstdio> //rename
+#include <cstring> //memchr, memcpy
+#include <memory> //shared_ptr
+#include <fcntl.h> //open
+#include <sys/mman.h> //mmap, madvise
+#include <sys/stat.h> //fstat
 
 //---------------------------------------------------------------------------
 // Standard names
@@ -75,21 +87,6 @@ using std::istringstream;
 // Constants
 //---------------------------------------------------------------------------
 
-// Define the B-events (unconditional events) of the system:
-#define B1 1 // Event: B1, Type: arrival, Change in system state:
-             // Px arrives and enters router queue.
-#define B2 2 // Event: B2, Type: arrival, Change in system state:
-             // Py arrives and enters router queue.
-#define B3 3 // Event: B3, Type: Departure, Change in system state:
-             // Router completes work and outputs
-             // Px to S1 queue, Py to S2 queue.
-#define B4 4 // Event: B4, Type: Departure, Change in system state:
-             // S1 completes work and packet leave the network
-             // (increment packets served Px by 1).
-#define B5 5 // Event: B5, Type: Departure, Change in system state:
-             // S2 completes work and packet leave the network
-             // (increment packets served Py by 1).
-
 // Router/Server states
 #define IDLE 0
 #define BUSY 1
@@ -118,19 +115,42 @@ int dFlag = 0; // debug flag
 int nFlag = 0; // random number stream generation flag
 int tFlag = 0; // simulation ending time flag
 int xFlag = 0; // simulation ending packet count flag
+int wFlag = 0; // warm-up deletion flag
+int hFlag = 0; // hybrid run flag, some stations served by a model
+
+// The trace of every event, -d, is compiled in only by make debug
+// (SimDebug). Elsewhere the tests of dFlag around it fold away, and the
+// handlers test no flag per event; -d then only adds to the reports.
+#ifdef SIM_DEBUG
+const bool TRACING = true;
+#else
+const bool TRACING = false;
+#endif
 
-double gSimulationTime; // Current simulation time
-double gLastEventTime; // Time of last event before the current one
-
-// Given mean interarrival times of Px and Py respectively
-double gPxInterArrivalTime, gPyInterArrivalTime;
-// Given mean service times of Router, Server 1 and Server 2 respectively
-double gRouterServiceTime, gS1ServiceTime, gS2ServiceTime;
-double gSigma, gSigma1, gSigma2; // Standard deviation of service times
+// Everything a run changes lives in its Simulation context, so that
+// replications can run side by side in threads.
+
+// Heap allocations of this thread so far, counted for --engine-stats and
+// the benchmark: every operator new of the program comes through here.
+// Each thread counts its own, so replications on all cores do not
+// contend for one counter; a run reads the count of the thread it runs
+// on.
+thread_local size_t tAllocations = 0;
+
+// Both are kept out of line, or g++ warns that the malloc and free
+// inside do not match the new and delete of the callers.
+__attribute__((noinline)) void* operator new (size_t size) {
+    tAllocations++;
+    void* p = malloc(size ? size : 1);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
 
-// Stream for output files for debugging
-ofstream gOutfile1;
-ofstream gOutfile2;
+__attribute__((noinline)) void operator delete (void* p) noexcept {
+    free(p);
+}
 
 //---------------------------------------------------------------------------
 // Helper to write to standard output and file
@@ -141,7 +161,7 @@ class Tee {
     template<typename T> friend Tee& operator<< (Tee&, T);
 public:
     Tee (ostream& f, ostream& s) : first(f), second(s) {}
-} gTee (cout, gOutfile1);
+};
 
 template <typename T>
 Tee& operator<< (Tee& rt, T val) {
@@ -150,35 +170,161 @@ Tee& operator<< (Tee& rt, T val) {
     return rt;
 }
 
+//---------------------------------------------------------------------------
+// Helpers to write and read checkpoints
+//---------------------------------------------------------------------------
+
+// A value is saved as its bytes, so a checkpoint is only read back by the
+// same build of the program. Get returns false once the file is short.
+template <typename T>
+void Put (ostream& out, const T& value) {
+    static_assert(std::is_trivially_copyable<T>::value, "saved as bytes");
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+bool Get (std::istream& in, T& value) {
+    static_assert(std::is_trivially_copyable<T>::value, "saved as bytes");
+    return static_cast<bool>(
+            in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+// A vector is saved as its size, then its elements
+template <typename T>
+void Put (ostream& out, const vector<T>& values) {
+    Put(out, values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        Put(out, values[i]);
+    }
+}
+
+template <typename T>
+bool Get (std::istream& in, vector<T>& values) {
+    size_t size;
+    if (!Get(in, size)) {
+        return false;
+    }
+    values.resize(size);
+    for (size_t i = 0; i < size; i++) {
+        if (!Get(in, values[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
 //---------------------------------------------------------------------------
 // Pseudo random number generator
 //---------------------------------------------------------------------------
 
+// xoshiro256** (Blackman and Vigna, 2018), period 2^256 - 1. A stream
+// splits into independent substreams with the jump functions: Jump moves
+// the stream 2^128 numbers ahead and LongJump 2^192 ahead, so replication
+// k starts k long jumps from the seed and each of its entities one jump
+// further than the previous one. An antithetic stream gives 1 - u for
+// each u of the same stream otherwise, its bits complemented.
 class RandomStream {
 public:
-    //static const int RANGE = 0x7fffffff; //RAND_MAX
-    static const double PI = 3.1415927;
+    static const double PI;
     double numNormals;
     double saveNormal;
-    RandomStream ();
-    ~RandomStream () {}
+    RandomStream (uint64_t seed = 0);
+    void Jump ();
+    void LongJump ();
+    void Antithetic () { mFlip = ~mFlip; }
     double Uniform ();
     double Exponential (double);
     double Normal (double, double);
     double NextNormal (double, double);
+
+    // Batched variates: fill n values at once. The transforms run as
+    // separate loops over the array, which the compiler may vectorize.
+    void Uniforms (double*, size_t);
+    void Exponentials (double*, size_t, double);
+    void Normals (double*, size_t, double, double);
+
+private:
+    uint64_t mState[4];
+    uint64_t mFlip; // all ones if antithetic
+
+    uint64_t Next ();
+    void Jump (const uint64_t*);
 };
 
-RandomStream* gpRandomStream;
+const double RandomStream::PI = 3.14159265358979323846;
 
-// Constructor
-RandomStream::RandomStream () {
+// Rotate x left by k bits
+static inline uint64_t Rotl (uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+// Constructor, expands the seed into the state with splitmix64
+RandomStream::RandomStream (uint64_t seed) {
     numNormals = 0;
     saveNormal = 0;
+    mFlip = 0;
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        mState[i] = z ^ (z >> 31);
+    }
+}
+
+// Return the next 64 random bits
+inline uint64_t RandomStream::Next () {
+    uint64_t result = Rotl(mState[1] * 5, 7) * 9;
+    uint64_t t = mState[1] << 17;
+    mState[2] ^= mState[0];
+    mState[3] ^= mState[1];
+    mState[1] ^= mState[2];
+    mState[0] ^= mState[3];
+    mState[2] ^= t;
+    mState[3] = Rotl(mState[3], 45);
+    return result;
+}
+
+// Advance the stream by the jump polynomial given
+void RandomStream::Jump (const uint64_t* poly) {
+    uint64_t s[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < 4; i++) {
+        for (int b = 0; b < 64; b++) {
+            if (poly[i] & (1ULL << b)) {
+                for (int k = 0; k < 4; k++) {
+                    s[k] ^= mState[k];
+                }
+            }
+            Next();
+        }
+    }
+    for (int k = 0; k < 4; k++) {
+        mState[k] = s[k];
+    }
+    numNormals = 0;
 }
 
-// Return the next random number.
+// Advance the stream by 2^128 numbers
+void RandomStream::Jump () {
+    static const uint64_t JUMP[] = {
+        0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+        0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL
+    };
+    Jump(JUMP);
+}
+
+// Advance the stream by 2^192 numbers
+void RandomStream::LongJump () {
+    static const uint64_t LONG_JUMP[] = {
+        0x76e15d3efefdcbbfULL, 0xc5004e441c522fb3ULL,
+        0x77710069854ee241ULL, 0x39109bb02acbe635ULL
+    };
+    Jump(LONG_JUMP);
+}
+
+// Return the next random number, uniform in (0, 1): the top 53 bits
+// centered in their interval, so 0 and 1 never come out.
 double RandomStream::Uniform () {
-    return (random()/(double)RAND_MAX);
+    return (((Next() ^ mFlip) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
 }
 
 // Return the next exponentially distributed random number
@@ -209,671 +355,4635 @@ double RandomStream::NextNormal (double mean, double sigma) {
     return ret;
 }
 
-//---------------------------------------------------------------------------
-// Event & Event Handler
-//---------------------------------------------------------------------------
-
-class Handler;
+// Fill out with n uniform random numbers in (0, 1)
+void RandomStream::Uniforms (double* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (((Next() ^ mFlip) >> 11) + 0.5)
+               * (1.0 / 9007199254740992.0);
+    }
+}
 
-// Event class
-class Event {
-public:
-    Handler* handler_; // handler to call when event ready
-    double time_; // time at which event is ready
-    int type_; // event type
-    Event (int type, double time) : time_(time), type_(type) {}
-};
+// Fill out with n exponentially distributed random numbers
+void RandomStream::Exponentials (double* out, size_t n, double mean) {
+    Uniforms(out, n);
+    for (size_t i = 0; i < n; i++) {
+        out[i] = -mean*log(out[i]);
+    }
+}
 
-// Event Handler base class
-class Handler {
-public:
-    virtual ~Handler () {} // virtual method
-    virtual void handle (Event*) = 0; // pure virtual method
-};
+// Fill out with n normally distributed random numbers, Box-Muller on
+// pairs of uniforms laid side by side
+void RandomStream::Normals (double* out, size_t n, double mean,
+                            double sigma) {
+    size_t pairs = n / 2;
+    Uniforms(out, 2 * pairs);
+    for (size_t i = 0; i < pairs; i++) {
+        double r = sqrt(-2*log(out[2*i]));
+        double theta = 2*PI*out[2*i + 1];
+        out[2*i] = r*cos(theta)*sigma + mean;
+        out[2*i + 1] = r*sin(theta)*sigma + mean;
+    }
+    if (n % 2) {
+        out[n - 1] = Normal(mean, sigma);
+    }
+}
 
 //---------------------------------------------------------------------------
-// Event Scheduler
+// Time distributions
 //---------------------------------------------------------------------------
 
-// Compare two events based on their time.
-struct EventCompare {
-    bool operator () (const Event* left, const Event* right) const {
-        return left->time_ > right->time_;
-    }
-};
+class VariateBuffer;
 
-// Event scheduler class
-class Scheduler {
+// Interarrival or service time distribution. Without random number
+// stream generation (-n) every sample is the mean. Samples below the
+// minimum (0 unless given) are drawn again; the minimum is also the
+// lookahead of a station in a parallel run.
+class Distribution {
 public:
-    Scheduler () : mEventQueue () {}
-    ~Scheduler ();
-    void Schedule (Handler*, Event*);
-    Event* Deque ();
-    void Dispatch (Event*);
+    enum Kind { FIXED, EXPONENTIAL, NORMAL, BYTES };
+    Distribution () : mKind(FIXED), mMean(0.0), mSigma(0.0), mMin(0.0) {}
+    bool Read (std::istream&);
+    double Mean () const { return mMean; }
+    double Variance () const;
+    double Min () const { return mKind == FIXED ? mMean : mMin; }
+    bool PerByte () const { return mKind == BYTES; }
+    double Sample (VariateBuffer&) const;
+    double Sample (VariateBuffer&, double) const;
+    void Fill (RandomStream&, vector<double>&) const;
 
 private:
-    priority_queue<Event*, vector<Event*>, EventCompare> mEventQueue;
-    // The queue holds the future event list (FEL). The lower time has
-    // higher priority
+    Kind mKind;
+    double mMean;
+    double mSigma;
+    double mMin;
+};
+
+// Read "exp <mean>", "rate <rate>" (exponential of mean 1/rate), "normal
+// <mean> <sigma>", "fixed <value>" or "bytes <rate>" (the size of the
+// packet over a rate in bytes per second, the mean being the time per
+// byte), then an optional "min <value>"
+bool Distribution::Read (std::istream& in) {
+    string name;
+    if (!(in >> name >> mMean) || mMean < 0) {
+        return false;
+    }
+    if (name == "exp") {
+        mKind = EXPONENTIAL;
+    } else if (name == "rate") {
+        if (mMean == 0) {
+            return false;
+        }
+        mKind = EXPONENTIAL;
+        mMean = 1 / mMean;
+    } else if (name == "normal") {
+        mKind = NORMAL;
+        if (!(in >> mSigma) || mSigma < 0) {
+            return false;
+        }
+    } else if (name == "fixed") {
+        mKind = FIXED;
+    } else if (name == "bytes") {
+        if (mMean == 0) {
+            return false;
+        }
+        mKind = BYTES;
+        mMean = 1 / mMean;
+    } else {
+        return false;
+    }
 
-} gScheduler;
+    std::streampos pos = in.tellg();
+    if (in >> name && name == "min") {
+        return (in >> mMin) && mMin >= 0 && mMin <= mMean;
+    }
+    in.clear();
+    in.seekg(pos);
+    return true;
+}
 
-// Destructor
-Scheduler::~Scheduler () {
-    while (!mEventQueue.empty()) {
-        delete mEventQueue.top ();
-        mEventQueue.pop ();
+// Return the variance, of the distribution before any minimum
+double Distribution::Variance () const {
+    switch (mKind) {
+    case EXPONENTIAL: return mMean * mMean;
+    case NORMAL: return mSigma * mSigma;
+    default: return 0;
     }
 }
 
-// Schedule event (insert to FEL)
-void Scheduler::Schedule (Handler* h, Event* p) {
-    if (dFlag) {
-        gTee << "[" << "B" << p->type_ << " " << p->time_ << "] ";
+// Fill values with the next batch of samples from stream, leaving out
+// those below the minimum: they are drawn as many as values holds, then
+// the rejected ones squeezed out without a branch. The samples kept are
+// those, in the same order, that drawing one at a time would give.
+void Distribution::Fill (RandomStream& stream, vector<double>& values) const {
+    size_t n = values.size();
+    if (mKind == EXPONENTIAL) {
+        stream.Exponentials(&values[0], n, mMean);
+    } else {
+        stream.Normals(&values[0], n, mMean, mSigma);
     }
-    p->handler_ = h;
-    mEventQueue.push(p); // The queue is sorted automatically as
-                         // new events are added.
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++) {
+        double x = values[i];
+        values[kept] = x;
+        kept += (x >= mMin);
+    }
+    values.resize(kept);
 }
 
-// Return the next event (removes from FEL)
-Event* Scheduler::Deque () {
-    Event* p = NULL;
-    if (!mEventQueue.empty()) {
-        p = mEventQueue.top();
-        mEventQueue.pop();
+// Samples of an entity from its own substream, drawn a batch at a time
+// by Distribution::Fill and handed out in order. The batches are even
+// sized, so the normal samples pair up as they do one at a time.
+class VariateBuffer {
+public:
+    static const size_t BATCH = 2048; // samples drawn at once
+    VariateBuffer () : mIndex(0) {}
+    void Seed (const RandomStream& stream) {
+        mStream = stream;
+        mValues.clear();
+        mIndex = 0;
     }
-    return p;
+    void Antithetic () {
+        mStream.Antithetic();
+        mValues.clear();
+        mIndex = 0;
+    }
+    double Next (const Distribution& d) {
+        while (mIndex == mValues.size()) {
+            mValues.resize(BATCH);
+            d.Fill(mStream, mValues);
+            mIndex = 0;
+        }
+        return mValues[mIndex++];
+    }
+    void Save (ostream& out) const {
+        Put(out, mStream);
+        Put(out, mValues);
+        Put(out, mIndex);
+    }
+    bool Load (std::istream& in) {
+        return Get(in, mStream) && Get(in, mValues) && Get(in, mIndex)
+            && mIndex <= mValues.size();
+    }
+
+private:
+    RandomStream mStream; // past the samples drawn
+    vector<double> mValues; // batch drawn
+    size_t mIndex; // next sample of the batch
+};
+
+const size_t VariateBuffer::BATCH;
+
+// Return the time of a packet of size bytes: the size over the rate, or
+// the next time if not per byte
+double Distribution::Sample (VariateBuffer& variates, double size) const {
+    return mKind == BYTES ? size * mMean : Sample(variates);
 }
 
-// Execute an event.
-void Scheduler::Dispatch (Event* p) {
-    p->handler_->handle(p); // calls the handler associated with the event
+// Return the next time
+double Distribution::Sample (VariateBuffer& variates) const {
+    if (nFlag || mKind == FIXED || mKind == BYTES) {
+        return mMean;
+    }
+    return variates.Next(*this);
 }
 
 //---------------------------------------------------------------------------
-// Packet & PacketQueue
+// Recorded arrivals
 //---------------------------------------------------------------------------
 
-// Packet class for PacketQueue element
-class Packet: public Event {
+// Packet log replayed by a trace source: a text file of one "<time>
+// [<size>]" line per packet, the times in seconds and never decreasing,
+// the sizes in bytes, on every line or on none; blank lines and '#'
+// comments are skipped. The times count from the first one, so a log
+// starts at time 0. The file is mapped into memory, read only, and the
+// mapping shared by every run replaying it: a run parses the lines as it
+// goes from its own offset, so even a log larger than memory is read in
+// order and never loaded whole. Open checks every line first, so a run
+// never meets a bad one.
+class PacketLog {
 public:
-    Packet (int type, double time): Event(type, time) {}
-};
-//XXX:
+    PacketLog ()
+        : mSizes(false), mOffset(0), mLine(0), mPackets(0), mFirst(0),
+          mLast(0) {}
+    static const size_t MAX_LINE = 256; // characters in a line at most
+    bool Open (const string&, string&);
+    bool IsOpen () const { return static_cast<bool>(mMap); }
+    bool Sizes () const { return mSizes; }
+    bool Next (double&, double&, string&);
+    void Save (ostream&) const;
+    bool Load (std::istream&);
 
-// Packet queue class
-class PacketQueue {
 private:
-    queue<Packet*> mQueue;
-    int mQueueSize;
-    double mTotalEmptyQueueTime;
+    // Read-only mapping of a file, unmapped with the last log using it
+    class Mapping {
+    public:
+        Mapping () : data_(NULL), size_(0) {}
+        ~Mapping () {
+            if (data_ != NULL) {
+                munmap(const_cast<char*>(data_), size_);
+            }
+        }
+        const char* data_;
+        size_t size_;
+    };
 
-public:
-    PacketQueue () : mQueueSize(0), mTotalEmptyQueueTime(0.0) {}
-    ~PacketQueue ();
-    void Enqueue (Packet*);
-    Packet* Dequeue ();
-    int QueueSize () const;
-    double TotalEmptyQueueTime () const;
+    std::shared_ptr<const Mapping> mMap;
+    string mName;
+    bool mSizes; // the lines give sizes
+    size_t mOffset; // of the next line in the file
+    size_t mLine; // lines read so far
+    size_t mPackets; // packets read so far
+    double mFirst; // time of the first packet
+    double mLast; // time of the last packet read
+    string Where () const;
 };
 
-PacketQueue* gpRouterQueue,* gpS1Queue,* gpS2Queue;
-
-// Destructor
-PacketQueue::~PacketQueue () {
-    while (mQueue.size() > 0) {
-        delete mQueue.front ();
-        mQueue.pop ();
+const size_t PacketLog::MAX_LINE;
+
+// Map the file name, see whether it gives sizes from its first packet,
+// and check all its lines. On error returns false with a message in
+// error.
+bool PacketLog::Open (const string& name, string& error) {
+    int fd = open(name.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        error = "cannot open " + name;
+        return false;
     }
-}
+    std::shared_ptr<Mapping> map(new Mapping);
+    if (st.st_size > 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            error = "cannot map " + name;
+            return false;
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        map->data_ = static_cast<const char*>(data);
+        map->size_ = st.st_size;
+    }
+    close(fd);
+    mMap = map;
+    mName = name;
 
-// Insert a new packet to the packet queue.
-void PacketQueue::Enqueue (Packet* p) {
-    if (mQueue.size() == 0) {
-        mTotalEmptyQueueTime += gSimulationTime;
+    PacketLog check(*this);
+    double time, size;
+    while (check.Next(time, size, error)) {
     }
-    mQueue.push(p);
-    mQueueSize += 1;
+    if (!error.empty()) {
+        return false;
+    }
+    mSizes = check.mSizes;
+    return true;
 }
 
-// Return the next packet (removes from the queue)
-Packet* PacketQueue::Dequeue () {
-    Packet* p = NULL;
-    if (mQueue.size()) {
-        p = mQueue.front();
-        mQueue.pop();
-        mQueueSize -= 1;
-        if (mQueue.size() == 0) {
-            mTotalEmptyQueueTime -= gSimulationTime;
+// Read the next packet: its time and size, 0 if the log gives none.
+// Returns false at the end of the log, or on error with a message in
+// error.
+bool PacketLog::Next (double& time, double& size, string& error) {
+    while (mOffset < mMap->size_) {
+        const char* begin = mMap->data_ + mOffset;
+        size_t left = mMap->size_ - mOffset;
+        const char* end = static_cast<const char*>(memchr(begin, '\n', left));
+        size_t length = (end != NULL) ? end - begin : left;
+        mOffset += length + (end != NULL);
+        mLine++;
+
+        char line[MAX_LINE];
+        if (length >= MAX_LINE) {
+            error = Where() + "line too long";
+            return false;
+        }
+        memcpy(line, begin, length);
+        line[length] = '\0';
+        char* comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        char* p;
+        char* q;
+        time = strtod(line, &p);
+        if (p == line) {
+            if (line[strspn(line, " \t\r")] == '\0') {
+                continue; // blank line
+            }
+            error = Where() + "bad packet";
+            return false;
+        }
+        size = strtod(p, &q);
+        bool sized = (q != p);
+        if (!sized) {
+            size = 0;
+        }
+        q += strspn(q, " \t\r");
+        if (mPackets == 0) {
+            mSizes = sized;
+            mFirst = mLast = time;
+        }
+        if (*q != '\0' || sized != mSizes || !std::isfinite(time)
+                || !std::isfinite(size) || size < 0) {
+            error = Where() + "bad packet";
+            return false;
+        }
+        if (time < mLast) {
+            error = Where() + "time goes back";
+            return false;
         }
+        mLast = time;
+        mPackets++;
+        time -= mFirst;
+        return true;
     }
-    return p;
+    return false;
 }
 
-// Return packet queue size.
-int PacketQueue::QueueSize () const {
-    return mQueueSize;
+// Return the place of the last line read, to start an error message
+string PacketLog::Where () const {
+    std::ostringstream where;
+    where << mName << ": line " << mLine << ": ";
+    return where.str();
 }
 
-// Return packet queue total empty time.
-double PacketQueue::TotalEmptyQueueTime () const {
-    double total;
-    if (mQueueSize > 0) {
-        total = mTotalEmptyQueueTime;
-    } else {
-        total = mTotalEmptyQueueTime + gSimulationTime;
-    }
-    return total;
+// Save the place reached in the log
+void PacketLog::Save (ostream& out) const {
+    Put(out, mOffset);
+    Put(out, mLine);
+    Put(out, mPackets);
+    Put(out, mFirst);
+    Put(out, mLast);
+}
+
+// Load the place reached in the same log
+bool PacketLog::Load (std::istream& in) {
+    return Get(in, mOffset) && Get(in, mLine) && Get(in, mPackets)
+        && Get(in, mFirst) && Get(in, mLast)
+        && (!mMap || mOffset <= mMap->size_);
 }
 
 //---------------------------------------------------------------------------
-// Service entity
+// Event
 //---------------------------------------------------------------------------
 
-class Service {
-private:
-    int mState;
-    size_t mTotalPacket;
-    double mTotalServiceTime;
-    double mArrivalTime;
-    double mTimeServiceBegin;
-    double mTimeServiceEnd;
-    double mTimePktWaitsInQueue;
-    double mTimePktSpendsInSystem;
-    double mIdleTimeOfService;
-    double mServiceTime;
+// Event types of the network
+enum EventType {
+    ARRIVAL, // packet from a source, id is the source
+    DEPARTURE, // end of service, id is the station
+    TRANSFER // packet from another logical process, id is the station
+};
+
+// Event record, 16 bytes kept by value in the FEL
+struct Event {
+    double time_; // time at which event is ready
+    uint32_t seq_; // scheduling order, breaks ties in time
+    uint16_t type_; // event type, selects the handler
+    uint16_t id_; // entity the event is about
+};
 
+// Packet, the element of a PacketQueue
+class Packet {
 public:
-    Service ();
-    ~Service () {}
-    int State () const { return mState; }
-    void State (int state) { mState= state; }
-    size_t TotalPacket () const { return mTotalPacket; }
-    double TotalServiceTime () const { return mTotalServiceTime; }
-    double ServiceTime() const { return mServiceTime; }
-    void stats (double);
+    double time_; // arrival time at the station
+    double entry_; // arrival time in the network
+    int class_; // packet class, index into the network classes
+    int hops_; // stations visited so far
+    int source_; // source the packet came from
+    double work_; // service time, drawn on arrival at a WFQ station
+    double tag_; // finish tag at a WFQ station, served lowest first
+    double size_; // bytes, given by the packet log of a trace source
+    Packet ()
+        : time_(0), entry_(0), class_(0), hops_(0), source_(0), work_(0),
+          tag_(0), size_(0) {}
 };
 
-Service* gpRouter,* gpS1,* gpS2;
+//---------------------------------------------------------------------------
+// Future event list
+//---------------------------------------------------------------------------
 
-// Constructor
-Service::Service () {
-    mState = IDLE;
-    mTotalServiceTime = 0.0;
-    mTotalPacket = 0;
-    mArrivalTime = 0.0;
-    mTimeServiceBegin = 0.0;
-    mTimeServiceEnd = 0.0;
-    mTimePktWaitsInQueue = 0.0;
-    mTimePktSpendsInSystem = 0.0;
-    mIdleTimeOfService = 0.0;
-    mServiceTime = 0.0;
-}
+// Compare two events based on their time. Events at the same time keep
+// the order in which they were scheduled, so every FEL yields the same
+// event sequence. The sequence numbers wrap around, which is fine as long
+// as no event stays pending while 2^31 others are scheduled.
+struct EventCompare {
+    bool operator () (const Event& left, const Event& right) const {
+        if (left.time_ != right.time_) {
+            return left.time_ > right.time_;
+        }
+        return static_cast<int32_t>(left.seq_ - right.seq_) > 0;
+    }
+};
 
-// Service entity stats
-void Service::stats (double t) {
-    mArrivalTime = t;
-    if (mArrivalTime > mTimeServiceEnd) {
-        mTimeServiceBegin = mArrivalTime;
-        mTimePktWaitsInQueue = 0;
-        mIdleTimeOfService = mArrivalTime - mTimeServiceEnd;
-    } else {
-        mTimeServiceBegin = mTimeServiceEnd;
-        mTimePktWaitsInQueue = mTimeServiceEnd - mArrivalTime;
-        mIdleTimeOfService = 0;
+// Same order the other way round: true if left comes first.
+struct EventEarlier {
+    bool operator () (const Event& left, const Event& right) const {
+        return EventCompare()(right, left);
     }
+};
 
-    mTimeServiceEnd = gSimulationTime;
-    mServiceTime = mTimeServiceEnd - mTimeServiceBegin;
-    mTimePktSpendsInSystem = mServiceTime + mTimePktWaitsInQueue;
+// Future event list (FEL) interface. The lower time has higher priority.
+class FutureEventList {
+public:
+    virtual ~FutureEventList () {}
+    virtual void Push (const Event&) = 0;
+    virtual bool Pop (Event&) = 0; // false when empty
+    virtual const Event* Peek (); // next event left in the FEL, or NULL
+    virtual size_t Size () const = 0;
 
-    mTotalServiceTime += mServiceTime;
-    mTotalPacket++;
+private:
+    Event mPeeked; // copy of the event returned by Peek
+};
 
-    if (dFlag > 1) {
-        gTee << "ArrivalTime=" << mArrivalTime << " "
-             << "TimeServiceBegin=" << mTimeServiceBegin << " "
-             << "ServiceTime=" << mServiceTime << " "
-             << "TimeServiceEnd=" << mTimeServiceEnd << " "
-             << "TimePktWaitsInQueue=" << mTimePktWaitsInQueue << " "
-             << "TimePktSpendsInSystem=" << mTimePktSpendsInSystem << " "
-             << "IdleTimeOfService=" << mIdleTimeOfService << " "
-        ;
+// Return the next event without removing it. Putting the event back
+// keeps its place, since the order does not depend on insertion.
+const Event* FutureEventList::Peek () {
+    if (!Pop(mPeeked)) {
+        return NULL;
     }
-
-    gOutfile2 << mArrivalTime << ","
-              << mTimeServiceBegin << ","
-              << mServiceTime << ","
-              << mTimeServiceEnd << ","
-              << mTimePktWaitsInQueue << ","
-              << mTimePktSpendsInSystem << ","
-              << mIdleTimeOfService << " "
-    ;
+    Push(mPeeked);
+    return &mPeeked;
 }
 
-//---------------------------------------------------------------------------
-// Helper for collecting and reporting statistics
-//---------------------------------------------------------------------------
+// Binary heap FEL, O(log n) per operation
+class HeapFEL : public FutureEventList {
+public:
+    void Push (const Event& e) { mHeap.push(e); }
+    bool Pop (Event&);
+    const Event* Peek () { return mHeap.empty() ? NULL : &mHeap.top(); }
+    size_t Size () const { return mHeap.size(); }
 
-class Stats {
 private:
-    size_t mTotalArrivals;
-    // Total Px served by R so far
-    size_t mTotalPxOnR;
-    // Total Py served by R so far
-    size_t mTotalPyOnR;
-    double mTotalWaitingTime;
-    // Mean interarrival times
-    double mMeanPxInterArrivalTime, mMeanPyInterArrivalTime;
-    // Mean service times
-    double mRMeanServiceTime, mS1MeanServiceTime, mS2MeanServiceTime;
-public:
-    Stats ();
-    ~Stats () {}
-    void IncrementArrivals () { mTotalArrivals += 1; };
-    size_t TotalArrivals () const { return mTotalArrivals; }
-    void ComputeTotalWaitingTime (double interval) {
-        mTotalWaitingTime += interval;
-    };
-    double TotalWaitingTime () const { return mTotalWaitingTime; }
-    void ComputeMeanPxInterArrivalTime (double);
-    void ComputeMeanPyInterArrivalTime (double);
-    void Report ();
+    priority_queue<Event, vector<Event>, EventCompare> mHeap;
 };
 
-Stats* gpStats;
-
-// Constructor
-Stats::Stats () {
-    mTotalArrivals = 0;
-    mTotalPxOnR=0;
-    mTotalPyOnR=0;
-    mTotalWaitingTime = 0;
-    mMeanPxInterArrivalTime = 0.0;
-    mMeanPyInterArrivalTime = 0.0;
-    mRMeanServiceTime = 0.0;
-    mS1MeanServiceTime = 0.0;
-    mS2MeanServiceTime = 0.0;
+// Return the next event (removes from FEL)
+bool HeapFEL::Pop (Event& e) {
+    if (mHeap.empty()) {
+        return false;
+    }
+    e = mHeap.top();
+    mHeap.pop();
+    return true;
 }
 
-// Compute the mean interarrival times of Px so far
-void Stats::ComputeMeanPxInterArrivalTime (double total) {
-    mTotalPxOnR++;
-    mMeanPxInterArrivalTime = total/mTotalPxOnR;
-}
+// Calendar queue FEL (R. Brown, CACM 1988), amortized O(1) per operation.
+// Time is cut into days of mWidth; day d is kept in bucket d mod nbuckets,
+// sorted, so a bucket holds the days of one calendar date over all years.
+// Dequeue walks the calendar from the current day. The number of buckets
+// doubles or halves with the queue size and the day width is re-estimated
+// from the spacing of the imminent events on every resize.
+class CalendarFEL : public FutureEventList {
+public:
+    CalendarFEL ();
+    void Push (const Event&);
+    bool Pop (Event&);
+    size_t Size () const { return mSize; }
 
-// Compute the mean interarrival times of Py so far
-void Stats::ComputeMeanPyInterArrivalTime (double total) {
-    mTotalPyOnR++;
-    mMeanPyInterArrivalTime = total/mTotalPyOnR;
-}
+private:
+    typedef unsigned long long Day;
+    static const size_t MIN_BUCKETS = 16;
+    static const size_t SAMPLE_SIZE = 25; // events sampled for the width
+
+    vector<vector<Event> > mBuckets; // each sorted latest first
+    size_t mMask; // number of buckets - 1 (a power of 2)
+    double mWidth; // time span of one day
+    Day mDay; // current day, no event is earlier
+    size_t mSize;
+
+    Day DayOf (double time) const { return (Day) (time / mWidth); }
+    void Insert (const Event&);
+    void Resize (size_t);
+};
 
-//---------------------------------------------------------------------------
-// Departure Event Handler
-//---------------------------------------------------------------------------
+const size_t CalendarFEL::MIN_BUCKETS;
+const size_t CalendarFEL::SAMPLE_SIZE;
 
-class DepartureHandler : public Handler {
-public:
-    ~DepartureHandler ();
-    void handle (Event*);
-} gDepartureHandler;
+// Constructor
+CalendarFEL::CalendarFEL ()
+    : mBuckets(MIN_BUCKETS), mMask(MIN_BUCKETS - 1), mWidth(1.0),
+      mDay(0), mSize(0) {
+}
 
-// Destructor
-DepartureHandler::~DepartureHandler () {
+// Put an event in the bucket of its day
+void CalendarFEL::Insert (const Event& e) {
+    vector<Event>& bucket = mBuckets[DayOf(e.time_) & mMask];
+    bucket.insert(std::upper_bound(bucket.begin(), bucket.end(), e,
+                                   EventCompare()), e);
 }
 
-// Event handler implementation for the derived class
-void DepartureHandler::handle (Event* event) {
-    if (dFlag > 1) {
-        gTee << "\nDEBUG: DepartureHandler: ";
+// Schedule event (insert to FEL)
+void CalendarFEL::Push (const Event& event) {
+    Event e = event;
+    if (e.time_ < 0) {
+        e.time_ = 0;
     }
+    Day day = DayOf(e.time_);
+    if (day < mDay) {
+        mDay = day;
+    }
+    Insert(e);
+    if (++mSize > 2 * mBuckets.size()) {
+        Resize(2 * mBuckets.size());
+    }
+}
 
-    if (event->type_ == B3) {
-        Packet* finished = gpRouterQueue->Dequeue();
-
-        gpStats -> ComputeTotalWaitingTime (
-                     gSimulationTime - finished->time_);
-
-        // Check to see whether the router queue is empty
-        if (gpRouterQueue->QueueSize () > 0) {
-            if (dFlag > 1) {
-                gTee << "{STATE: R BUSY} ";
+// Return the next event (removes from FEL)
+bool CalendarFEL::Pop (Event& e) {
+    if (mSize == 0) {
+        return false;
+    }
+    for (;;) {
+        // Walk one year of the calendar from the current day
+        for (size_t n = 0; n <= mMask; n++, mDay++) {
+            vector<Event>& bucket = mBuckets[mDay & mMask];
+            if (!bucket.empty() && DayOf(bucket.back().time_) <= mDay) {
+                e = bucket.back();
+                bucket.pop_back();
+                if (--mSize < mBuckets.size() / 2 - 2
+                                && mBuckets.size() > MIN_BUCKETS) {
+                    Resize(mBuckets.size() / 2);
+                }
+                return true;
             }
+        }
+        // Nothing within a year: jump straight to the earliest event
+        const Event* first = NULL;
+        for (size_t i = 0; i <= mMask; i++) {
+            if (!mBuckets[i].empty() && (first == NULL
+                            || EventCompare()(*first, mBuckets[i].back()))) {
+                first = &mBuckets[i].back();
+            }
+        }
+        mDay = DayOf(first->time_);
+    }
+}
 
-            // Schedule the next departure (B3 event).
-            double serviceTime;
-            !nFlag
-                ? serviceTime = gpRandomStream->NextNormal(
-                                                  gRouterServiceTime, gSigma)
-                : serviceTime = gRouterServiceTime;
-
-            gScheduler.Schedule(&gDepartureHandler,
-                               new Event(B3, gSimulationTime + serviceTime));
+// Rebuild the calendar with nbuckets buckets and a fresh day width
+void CalendarFEL::Resize (size_t nbuckets) {
+    vector<Event> events;
+    events.reserve(mSize);
+    for (size_t i = 0; i <= mMask; i++) {
+        events.insert(events.end(), mBuckets[i].begin(), mBuckets[i].end());
+    }
 
-        } else {
-            gpRouter->State(IDLE); // Begin idle time
-            if (dFlag > 1) {
-                gTee << "{STATE: R IDLE} ";
+    // The width is three times the mean spacing of the imminent events,
+    // leaving out spacings more than twice the first mean.
+    size_t n = std::min(events.size(), SAMPLE_SIZE);
+    if (n > 1) {
+        std::partial_sort(events.begin(), events.begin() + n, events.end(),
+                          EventEarlier());
+        double mean = (events[n - 1].time_ - events[0].time_) / (n - 1);
+        double sum = 0;
+        size_t count = 0;
+        for (size_t i = 1; i < n; i++) {
+            double gap = events[i].time_ - events[i - 1].time_;
+            if (gap <= 2 * mean) {
+                sum += gap;
+                count++;
             }
         }
-
-        // Compute and display some stats on router so far
-        if (dFlag > 1) {
-            gTee << "SimulationTime=" << gSimulationTime << " "
-                 << "LastEventTime=" << gLastEventTime << " "
-                 << "finished=" << finished->time_
-                 << " (B" << finished->type_ << ") "
-            ;
+        if (count > 0 && sum > 0) {
+            mWidth = 3 * sum / count;
         }
+    }
 
-        gpStats->IncrementArrivals();
+    mBuckets.assign(nbuckets, vector<Event>());
+    mMask = nbuckets - 1;
+    mDay = (Day) -1;
+    for (size_t i = 0; i < events.size(); i++) {
+        Insert(events[i]);
+        mDay = std::min(mDay, DayOf(events[i].time_));
+    }
+    if (events.empty()) {
+        mDay = 0;
+    }
+}
 
-        gOutfile2 << "\nR" << "," << gpStats->TotalArrivals() << ",";
+// Create a FEL by name, NULL if unknown
+FutureEventList* NewFEL (const string& name) {
+    if (name == "heap") {
+        return new HeapFEL;
+    } else if (name == "calendar") {
+        return new CalendarFEL;
+    }
+    return NULL;
+}
 
-        if (finished->type_ == B1) {
-            gOutfile2 << "Px" << ",";
-        } else if (finished->type_ == B2) {
-            gOutfile2 << "Py" << ",";
+//---------------------------------------------------------------------------
+// Event Scheduler
+//---------------------------------------------------------------------------
+
+// Event scheduler class. Events are plain records: the run dispatches
+// them on their type, with no handler pointer nor virtual call.
+class Scheduler {
+public:
+    Scheduler () : mFEL(new HeapFEL), mSeq(0) {}
+    ~Scheduler () { delete mFEL; }
+    void UseFEL (FutureEventList*);
+    void Schedule (int, int, double);
+    bool Deque (Event& e) { return mFEL->Pop(e); }
+    const Event* Peek () { return mFEL->Peek(); }
+    size_t Size () const { return mFEL->Size(); }
+    void Save (ostream&);
+    bool Load (std::istream&);
+
+private:
+    FutureEventList* mFEL; // the future event list
+    uint32_t mSeq; // events scheduled so far, mod 2^32
+
+    Scheduler (const Scheduler&);
+    Scheduler& operator= (const Scheduler&);
+};
+
+// Replace the FEL, before any event is scheduled
+void Scheduler::UseFEL (FutureEventList* fel) {
+    delete mFEL;
+    mFEL = fel;
+}
+
+// Schedule an event of a type about entity id at time (insert to FEL)
+void Scheduler::Schedule (int type, int id, double time) {
+    Event e;
+    e.time_ = time;
+    e.seq_ = mSeq++;
+    e.type_ = static_cast<uint16_t>(type);
+    e.id_ = static_cast<uint16_t>(id);
+    mFEL->Push(e); // The queue is sorted automatically as
+                   // new events are added.
+}
+
+// Save the pending events, taken out and put back in the FEL
+void Scheduler::Save (ostream& out) {
+    vector<Event> events;
+    Event e;
+    while (mFEL->Pop(e)) {
+        events.push_back(e);
+    }
+    for (size_t i = 0; i < events.size(); i++) {
+        mFEL->Push(events[i]);
+    }
+    Put(out, mSeq);
+    Put(out, events);
+}
+
+// Load the pending events in place of the ones in the FEL. They keep
+// their sequence numbers, so they come out in the same order whatever
+// the FEL.
+bool Scheduler::Load (std::istream& in) {
+    vector<Event> events;
+    if (!Get(in, mSeq) || !Get(in, events)) {
+        return false;
+    }
+    Event e;
+    while (mFEL->Pop(e)) {
+    }
+    for (size_t i = 0; i < events.size(); i++) {
+        mFEL->Push(events[i]);
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------------
+// Streaming statistics
+//---------------------------------------------------------------------------
+
+// Mean and variance of a series, updated one value at a time (Welford)
+class Moments {
+public:
+    Moments () : mCount(0), mMean(0.0), mM2(0.0) {}
+    void Add (double x) {
+        mCount++;
+        double delta = x - mMean;
+        mMean += delta / mCount;
+        mM2 += delta * (x - mMean);
+    }
+    void Merge (const Moments&);
+    size_t Count () const { return mCount; }
+    double Mean () const { return mMean; }
+    double Variance () const {
+        return mCount > 1 ? mM2 / (mCount - 1) : 0.0;
+    }
+    double StdDev () const { return sqrt(Variance()); }
+
+private:
+    size_t mCount;
+    double mMean;
+    double mM2; // sum of squared deviations from the mean
+};
+
+// Add the values of another series (Chan et al.)
+void Moments::Merge (const Moments& other) {
+    if (other.mCount == 0) {
+        return;
+    }
+    if (mCount == 0) {
+        *this = other;
+        return;
+    }
+    size_t count = mCount + other.mCount;
+    double delta = other.mMean - mMean;
+    mMean += delta * other.mCount / count;
+    mM2 += other.mM2 + delta * delta * mCount * other.mCount / count;
+    mCount = count;
+}
+
+// Quantile p of a series estimated in constant space with five markers
+// (P-square algorithm, Jain and Chlamtac, CACM 1985)
+class P2Quantile {
+public:
+    P2Quantile (double p = 0.5);
+    void Add (double);
+    double Value () const;
+
+private:
+    double mP;
+    size_t mCount;
+    double mHeights[5]; // marker heights, the first values until 5
+    double mPositions[5]; // marker positions
+    double mDesired[5]; // desired marker positions
+    double mIncrements[5]; // increments of the desired positions
+};
+
+// Constructor
+P2Quantile::P2Quantile (double p) : mP(p), mCount(0) {
+    double desired[5] = { 1, 1 + 2*p, 1 + 4*p, 3 + 2*p, 5 };
+    double increments[5] = { 0, p/2, p, (1 + p)/2, 1 };
+    for (int i = 0; i < 5; i++) {
+        mHeights[i] = 0;
+        mPositions[i] = i + 1;
+        mDesired[i] = desired[i];
+        mIncrements[i] = increments[i];
+    }
+}
+
+// Add a value to the series
+void P2Quantile::Add (double x) {
+    if (mCount < 5) {
+        mHeights[mCount++] = x;
+        if (mCount == 5) {
+            std::sort(mHeights, mHeights + 5);
+        }
+        return;
+    }
+    mCount++;
+
+    // Find the cell of x, stretching the extreme markers if needed
+    int k;
+    if (x < mHeights[0]) {
+        mHeights[0] = x;
+        k = 0;
+    } else if (x >= mHeights[4]) {
+        mHeights[4] = x;
+        k = 3;
+    } else {
+        k = 0;
+        while (x >= mHeights[k + 1]) {
+            k++;
+        }
+    }
+    for (int i = k + 1; i < 5; i++) {
+        mPositions[i]++;
+    }
+    for (int i = 0; i < 5; i++) {
+        mDesired[i] += mIncrements[i];
+    }
+
+    // Move the middle markers toward their desired positions
+    for (int i = 1; i < 4; i++) {
+        double d = mDesired[i] - mPositions[i];
+        if ((d >= 1 && mPositions[i + 1] - mPositions[i] > 1)
+                || (d <= -1 && mPositions[i - 1] - mPositions[i] < -1)) {
+            int s = d > 0 ? 1 : -1;
+            double n0 = mPositions[i - 1], n1 = mPositions[i];
+            double n2 = mPositions[i + 1];
+            double h0 = mHeights[i - 1], h1 = mHeights[i];
+            double h2 = mHeights[i + 1];
+
+            // Piecewise parabolic prediction, else linear
+            double h = h1 + s / (n2 - n0) * ((n1 - n0 + s) * (h2 - h1)
+                         / (n2 - n1) + (n2 - n1 - s) * (h1 - h0) / (n1 - n0));
+            if (h <= h0 || h >= h2) {
+                h = h1 + s * (mHeights[i + s] - h1)
+                           / (mPositions[i + s] - n1);
+            }
+            mHeights[i] = h;
+            mPositions[i] += s;
+        }
+    }
+}
+
+// Return the estimate, exact for fewer than five values
+double P2Quantile::Value () const {
+    if (mCount >= 5) {
+        return mHeights[2];
+    }
+    if (mCount == 0) {
+        return 0.0;
+    }
+    double sorted[5];
+    std::copy(mHeights, mHeights + mCount, sorted);
+    std::sort(sorted, sorted + mCount);
+    size_t rank = (size_t) (mP * mCount);
+    return sorted[std::min(rank, mCount - 1)];
+}
+
+// Quantiles reported for waits and times spent
+const double QUANTILES[] = { 0.50, 0.95, 0.99 };
+const char* const QUANTILE_NAMES[] = { "p50", "p95", "p99" };
+const size_t NUM_QUANTILES = sizeof(QUANTILES) / sizeof(QUANTILES[0]);
+
+// Moments and quantiles of a series
+class Summary : public Moments {
+public:
+    Summary () {
+        for (size_t q = 0; q < NUM_QUANTILES; q++) {
+            mQuantiles[q] = P2Quantile(QUANTILES[q]);
+        }
+    }
+    void Add (double x) {
+        Moments::Add(x);
+        for (size_t q = 0; q < NUM_QUANTILES; q++) {
+            mQuantiles[q].Add(x);
+        }
+    }
+    double Quantile (size_t q) const;
+
+private:
+    P2Quantile mQuantiles[NUM_QUANTILES];
+};
+
+// Return quantile q. Each is estimated on its own, and the estimates of
+// nearby quantiles may cross: a quantile is reported no lower than the
+// ones below it.
+double Summary::Quantile (size_t q) const {
+    double value = mQuantiles[0].Value();
+    for (size_t k = 1; k <= q; k++) {
+        value = std::max(value, mQuantiles[k].Value());
+    }
+    return value;
+}
+
+// Student t quantiles t(0.975, df) for df = 1..30
+const double T975[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+// Return t(0.975, df). Past the table, the normal quantile with the first
+// Cornish-Fisher correction is within 0.001 of it.
+double StudentT975 (size_t df) {
+    if (df <= 30) {
+        return T975[df - 1];
+    }
+    const double z = 1.959964;
+    return z + (z*z*z + z)/(4.0*df);
+}
+
+//---------------------------------------------------------------------------
+// Steady-state estimation
+//---------------------------------------------------------------------------
+
+// Detects the end of the warm-up of a series with MSER-5 (White, 1997):
+// the series is averaged in batches of 5, and the warm-up is the number
+// d of first batches whose deletion minimizes the squared standard error
+// of the rest, sum (Z_i - mean)^2 / (n - d)^2. It is accepted once it
+// lies in the first half of the series, checked each time the number of
+// batches doubles.
+class WarmUp {
+public:
+    static const size_t BATCH = 5; // observations per batch
+    static const size_t MIN_BATCHES = 20; // batches at the first check
+
+    WarmUp () : mSum(0.0), mCount(0), mCheck(MIN_BATCHES), mDone(false) {}
+    bool Add (double);
+    bool Done () const { return mDone; }
+    void Save (ostream&) const;
+    bool Load (std::istream&);
+
+private:
+    vector<double> mBatches; // means of the batches so far
+    double mSum; // sum of the current batch
+    size_t mCount; // observations in the current batch
+    size_t mCheck; // batches at the next check
+    bool mDone; // the warm-up is over
+
+    size_t Truncation () const;
+};
+
+// Add an observation, return true when it ends the warm-up
+bool WarmUp::Add (double x) {
+    if (mDone) {
+        return false;
+    }
+    mSum += x;
+    if (++mCount < BATCH) {
+        return false;
+    }
+    mBatches.push_back(mSum / BATCH);
+    mSum = 0.0;
+    mCount = 0;
+
+    if (mBatches.size() == mCheck) {
+        mCheck *= 2;
+        if (Truncation() < mBatches.size() / 2) {
+            mDone = true;
+            mBatches.clear();
+        }
+    }
+    return mDone;
+}
+
+// Save the state of the detection
+void WarmUp::Save (ostream& out) const {
+    Put(out, mBatches);
+    Put(out, mSum);
+    Put(out, mCount);
+    Put(out, mCheck);
+    Put(out, mDone);
+}
+
+// Load the state of the detection
+bool WarmUp::Load (std::istream& in) {
+    return Get(in, mBatches) && Get(in, mSum) && Get(in, mCount)
+        && Get(in, mCheck) && Get(in, mDone);
+}
+
+// Return the batches to delete minimizing the MSER statistic, at most
+// half of them
+size_t WarmUp::Truncation () const {
+    size_t n = mBatches.size();
+    size_t best = n / 2;
+    double bestStat = 0.0;
+    Moments rest; // batches from d on
+    for (size_t d = n; d-- > 0; ) {
+        rest.Add(mBatches[d]);
+        if (d > n / 2) {
+            continue;
+        }
+        double k = static_cast<double>(n - d);
+        double stat = rest.Variance() * (k - 1) / (k * k);
+        if (d == n / 2 || stat <= bestStat) {
+            best = d;
+            bestStat = stat;
+        }
+    }
+    return best;
+}
+
+// Batch means of a steady-state series: the observations are averaged in
+// batches, and once 2 * BATCHES of them are full they are merged two by
+// two and the batch size doubles, so there are always BATCHES to
+// 2 * BATCHES batches, whatever the length of the run. The batch means
+// are taken as independent for the confidence interval of the mean.
+class BatchMeans {
+public:
+    static const size_t BATCHES = 20; // minimum number of batches
+
+    BatchMeans () : mSize(1), mSum(0.0), mCount(0) {}
+    bool Add (double);
+    size_t Batches () const { return mBatches.size(); }
+    size_t BatchSize () const { return mSize; }
+    double Mean () const;
+    double HalfWidth () const;
+    void Save (ostream&) const;
+    bool Load (std::istream&);
+
+private:
+    vector<double> mBatches; // means of the full batches
+    size_t mSize; // observations per batch
+    double mSum; // sum of the current batch
+    size_t mCount; // observations in the current batch
+};
+
+// Add an observation, return true when it fills a batch
+bool BatchMeans::Add (double x) {
+    mSum += x;
+    if (++mCount < mSize) {
+        return false;
+    }
+    mBatches.push_back(mSum / mSize);
+    mSum = 0.0;
+    mCount = 0;
+
+    if (mBatches.size() == 2 * BATCHES) {
+        for (size_t b = 0; b < BATCHES; b++) {
+            mBatches[b] = (mBatches[2*b] + mBatches[2*b + 1]) / 2;
+        }
+        mBatches.resize(BATCHES);
+        mSize *= 2;
+    }
+    return true;
+}
+
+// Save the batches
+void BatchMeans::Save (ostream& out) const {
+    Put(out, mBatches);
+    Put(out, mSize);
+    Put(out, mSum);
+    Put(out, mCount);
+}
+
+// Load the batches
+bool BatchMeans::Load (std::istream& in) {
+    return Get(in, mBatches) && Get(in, mSize) && Get(in, mSum)
+        && Get(in, mCount);
+}
+
+// Return the mean of the full batches
+double BatchMeans::Mean () const {
+    Moments moments;
+    for (size_t b = 0; b < mBatches.size(); b++) {
+        moments.Add(mBatches[b]);
+    }
+    return moments.Mean();
+}
+
+// Return the half width of the 95% confidence interval of the mean, 0
+// with less than two batches
+double BatchMeans::HalfWidth () const {
+    size_t n = mBatches.size();
+    if (n < 2) {
+        return 0.0;
+    }
+    Moments moments;
+    for (size_t b = 0; b < n; b++) {
+        moments.Add(mBatches[b]);
+    }
+    return StudentT975(n - 1) * moments.StdDev() / sqrt(n);
+}
+
+//---------------------------------------------------------------------------
+// PacketQueue
+//---------------------------------------------------------------------------
+
+// Ring buffer of packets: of a fixed size, allocated once, or doubled
+// as needed
+class PacketRing {
+public:
+    PacketRing (size_t size = INITIAL_SIZE, bool fixed = false)
+        : mRing(size), mHead(0), mSize(0), mFixed(fixed) {}
+    static const size_t INITIAL_SIZE = 16; // of a growing ring
+    void Push (const Packet&);
+    Packet Pop ();
+    const Packet& Front () const { return mRing[mHead]; }
+    size_t Size () const { return mSize; }
+    void Save (ostream&) const;
+    bool Load (std::istream&);
+
+private:
+    vector<Packet> mRing;
+    size_t mHead; // ring index of the first packet
+    size_t mSize; // packets in the ring
+    bool mFixed; // of a fixed size, never full when pushed to
+};
+
+const size_t PacketRing::INITIAL_SIZE;
+
+// Add a packet at the back
+void PacketRing::Push (const Packet& p) {
+    if (mSize == mRing.size()) {
+        // Unroll the ring into one twice its size
+        vector<Packet> ring(2 * mRing.size());
+        for (size_t i = 0; i < mSize; i++) {
+            ring[i] = mRing[(mHead + i) % mRing.size()];
+        }
+        mRing.swap(ring);
+        mHead = 0;
+    }
+    mRing[(mHead + mSize) % mRing.size()] = p;
+    mSize += 1;
+}
+
+// Remove and return the packet at the front, which must be there
+Packet PacketRing::Pop () {
+    Packet p = mRing[mHead];
+    mHead = (mHead + 1) % mRing.size();
+    mSize -= 1;
+    return p;
+}
+
+// Save the packets, front first
+void PacketRing::Save (ostream& out) const {
+    Put(out, mSize);
+    for (size_t i = 0; i < mSize; i++) {
+        Put(out, mRing[(mHead + i) % mRing.size()]);
+    }
+}
+
+// Load the packets in place of the ones in the ring
+bool PacketRing::Load (std::istream& in) {
+    size_t size;
+    if (!Get(in, size) || (mFixed && size > mRing.size())) {
+        return false;
+    }
+    mHead = 0;
+    mSize = 0;
+    for (size_t i = 0; i < size; i++) {
+        Packet p;
+        if (!Get(in, p)) {
+            return false;
+        }
+        Push(p);
+    }
+    return true;
+}
+
+// Packet queue class. It counts the packets at a station, the ones in
+// service included, for the queue size stats and the capacity of a
+// finite queue, and keeps the waiting ones: in one lane, or in one lane
+// per class for a station choosing among the classes. A finite queue
+// allocates its lanes once, of its capacity.
+class PacketQueue {
+private:
+    vector<PacketRing> mLanes;
+    size_t mCapacity; // packets at most, 0 if unbounded
+    size_t mWaiting; // packets in the lanes
+    int mQueueSize;
+    double mTotalEmptyQueueTime;
+    double mArea; // integral of the queue size over time
+    double mLastChange; // time the queue size last changed
+    double mStart; // time the stats were last reset
+
+    void Shape (size_t, size_t);
+
+public:
+    PacketQueue ()
+        : mLanes(1), mCapacity(0), mWaiting(0), mQueueSize(0),
+          mTotalEmptyQueueTime(0.0), mArea(0.0), mLastChange(0.0),
+          mStart(0.0) {}
+    ~PacketQueue () {}
+    void Enqueue (const Packet&, double);
+    Packet Take (size_t);
+    void Leave (double);
+    const Packet& Front (size_t lane) const {
+        return mLanes[lane].Front();
+    }
+    size_t Waiting () const { return mWaiting; }
+    size_t Waiting (size_t lane) const { return mLanes[lane].Size(); }
+    int QueueSize () const;
+    size_t Capacity () const { return mCapacity; }
+    void Capacity (size_t capacity) { Shape(capacity, mLanes.size()); }
+    size_t Lanes () const { return mLanes.size(); }
+    void Lanes (size_t lanes) { Shape(mCapacity, lanes); }
+    bool Full () const {
+        return mCapacity > 0 && (size_t) mQueueSize >= mCapacity;
+    }
+    double TotalEmptyQueueTime (double) const;
+    double MeanQueueSize (double) const;
+    // Count a packet that spent time at the station, not queued
+    void Spend (double time) { mArea += time; }
+    void Reset (double);
+    void Save (ostream&) const;
+    bool Load (std::istream&);
+};
+
+// Give the empty queue a capacity, 0 for unbounded, and lanes
+void PacketQueue::Shape (size_t capacity, size_t lanes) {
+    mCapacity = capacity;
+    mLanes.assign(lanes, capacity > 0 ? PacketRing(capacity, true)
+                                      : PacketRing());
+}
+
+// Insert a new packet to the packet queue at time now, in the lane of its
+// class if there is one per class. A full finite queue is left to the
+// caller, which drops or blocks the packet.
+void PacketQueue::Enqueue (const Packet& p, double now) {
+    if (mQueueSize == 0) {
+        mTotalEmptyQueueTime += now;
+    }
+    mArea += mQueueSize * (now - mLastChange);
+    mLastChange = now;
+    mLanes[mLanes.size() > 1 ? p.class_ : 0].Push(p);
+    mWaiting += 1;
+    mQueueSize += 1;
+}
+
+// Return the first packet waiting in a lane, which goes into service:
+// it is still counted at the station until it leaves
+Packet PacketQueue::Take (size_t lane) {
+    mWaiting -= 1;
+    return mLanes[lane].Pop();
+}
+
+// A packet taken into service leaves the station at time now
+void PacketQueue::Leave (double now) {
+    mArea += mQueueSize * (now - mLastChange);
+    mLastChange = now;
+    mQueueSize -= 1;
+    if (mQueueSize == 0) {
+        mTotalEmptyQueueTime -= now;
+    }
+}
+
+// Return packet queue size.
+int PacketQueue::QueueSize () const {
+    return mQueueSize;
+}
+
+// Return packet queue total empty time up to time now.
+double PacketQueue::TotalEmptyQueueTime (double now) const {
+    double total;
+    if (mQueueSize > 0) {
+        total = mTotalEmptyQueueTime;
+    } else {
+        total = mTotalEmptyQueueTime + now;
+    }
+    return total;
+}
+
+// Return the time-weighted mean queue size up to time now, the packets
+// in service included.
+double PacketQueue::MeanQueueSize (double now) const {
+    if (now <= mStart) {
+        return 0.0;
+    }
+    return (mArea + mQueueSize * (now - mLastChange)) / (now - mStart);
+}
+
+// Save the waiting packets and the stats
+void PacketQueue::Save (ostream& out) const {
+    for (size_t lane = 0; lane < mLanes.size(); lane++) {
+        mLanes[lane].Save(out);
+    }
+    Put(out, mWaiting);
+    Put(out, mQueueSize);
+    Put(out, mTotalEmptyQueueTime);
+    Put(out, mArea);
+    Put(out, mLastChange);
+    Put(out, mStart);
+}
+
+// Load the waiting packets and the stats into the empty queue
+bool PacketQueue::Load (std::istream& in) {
+    for (size_t lane = 0; lane < mLanes.size(); lane++) {
+        if (!mLanes[lane].Load(in)) {
+            return false;
+        }
+    }
+    return Get(in, mWaiting) && Get(in, mQueueSize)
+        && Get(in, mTotalEmptyQueueTime) && Get(in, mArea)
+        && Get(in, mLastChange) && Get(in, mStart);
+}
+
+// Restart the empty time and the mean queue size at time now, keeping
+// the packets queued.
+void PacketQueue::Reset (double now) {
+    mTotalEmptyQueueTime = (mQueueSize > 0) ? 0.0 : -now;
+    mArea = 0.0;
+    mLastChange = now;
+    mStart = now;
+}
+
+//---------------------------------------------------------------------------
+// Random early detection
+//---------------------------------------------------------------------------
+
+// RED (Floyd and Jacobson, 1993) drops a packet arriving at a finite
+// queue with a probability that grows from 0 to maxp as the average queue
+// size goes from min to max, and always above max. The average is an
+// exponentially weighted moving average of the queue size at arrivals;
+// over an idle period it decays as if packets of the mean service time
+// had found the queue empty. The probability is spread by the count of
+// packets since the last drop, so drops come at even intervals. Without
+// random number stream generation (-n) a packet is dropped once that
+// spread probability reaches 1.
+class Red {
+public:
+    Red ()
+        : mMin(0), mMax(0), mMaxP(0), mWeight(DEFAULT_WEIGHT),
+          mAverage(0), mCount(-1), mIdleSince(0) {}
+    static const double DEFAULT_WEIGHT; // of the last queue size
+    bool Read (std::istream&);
+    bool Drop (int, double, double, RandomStream&);
+    void Idle (double now) { mIdleSince = now; }
+
+private:
+    double mMin; // average queue size where drops start
+    double mMax; // average queue size where every packet is dropped
+    double mMaxP; // drop probability at max
+    double mWeight; // weight of the last queue size in the average
+    double mAverage; // average queue size
+    int mCount; // packets since the last drop, -1 below min
+    double mIdleSince; // time the queue became empty
+};
+
+const double Red::DEFAULT_WEIGHT = 0.002;
+
+// Read "<min> <max> <maxp>", then an optional "weight <value>"
+bool Red::Read (std::istream& in) {
+    if (!(in >> mMin >> mMax >> mMaxP) || mMin < 0 || mMax <= mMin
+                || mMaxP <= 0 || mMaxP > 1) {
+        return false;
+    }
+    std::streampos pos = in.tellg();
+    string name;
+    if (in >> name && name == "weight") {
+        return (in >> mWeight) && mWeight > 0 && mWeight <= 1;
+    }
+    in.clear();
+    in.seekg(pos);
+    return true;
+}
+
+// Return true to drop a packet arriving at time now at a queue of size
+// packets, served in service seconds on average; the random draw comes
+// from stream
+bool Red::Drop (int size, double now, double service, RandomStream& stream) {
+    if (size > 0) {
+        mAverage += mWeight * (size - mAverage);
+    } else if (service > 0) {
+        mAverage *= pow(1 - mWeight, (now - mIdleSince) / service);
+    } else {
+        mAverage = 0;
+    }
+
+    if (mAverage < mMin) {
+        mCount = -1;
+        return false;
+    }
+    if (mAverage >= mMax) {
+        mCount = 0;
+        return true;
+    }
+    mCount++;
+    double p = mMaxP * (mAverage - mMin) / (mMax - mMin);
+    bool drop = (mCount * p >= 1)
+             || (!nFlag && stream.Uniform() * (1 - mCount * p) < p);
+    if (drop) {
+        mCount = 0;
+    }
+    return drop;
+}
+
+//---------------------------------------------------------------------------
+// Service entity
+//---------------------------------------------------------------------------
+
+class Service {
+private:
+    int mState;
+    size_t mTotalPacket;
+    double mTotalServiceTime;
+    double mArrivalTime;
+    double mTimeServiceBegin;
+    double mTimeServiceEnd;
+    double mTimePktWaitsInQueue;
+    double mTimePktSpendsInSystem;
+    double mIdleTimeOfService;
+    double mServiceTime;
+    Moments mServiceTimes; // service times
+    Summary mWaits; // waits in queue
+    Summary mSpends; // times spent at the station
+
+public:
+    Service ();
+    int State () const { return mState; }
+    void State (int state) { mState= state; }
+    size_t TotalPacket () const { return mTotalPacket; }
+    double TotalServiceTime () const { return mTotalServiceTime; }
+    double ServiceTime() const { return mServiceTime; }
+    double ArrivalTime () const { return mArrivalTime; }
+    double TimeServiceBegin () const { return mTimeServiceBegin; }
+    double TimeServiceEnd () const { return mTimeServiceEnd; }
+    double IdleTimeOfService () const { return mIdleTimeOfService; }
+    const Moments& ServiceTimes () const { return mServiceTimes; }
+    const Summary& Waits () const { return mWaits; }
+    const Summary& Spends () const { return mSpends; }
+    void stats (double, double, double, Tee&);
+    void Release (double now) { mTimeServiceEnd = now; }
+    void Reset ();
+};
+
+// Constructor
+Service::Service () {
+    mState = IDLE;
+    mTotalServiceTime = 0.0;
+    mTotalPacket = 0;
+    mArrivalTime = 0.0;
+    mTimeServiceBegin = 0.0;
+    mTimeServiceEnd = 0.0;
+    mTimePktWaitsInQueue = 0.0;
+    mTimePktSpendsInSystem = 0.0;
+    mIdleTimeOfService = 0.0;
+    mServiceTime = 0.0;
+}
+
+// Restart the stats, keeping the state of the service
+void Service::Reset () {
+    mTotalServiceTime = 0.0;
+    mTotalPacket = 0;
+    mServiceTimes = Moments();
+    mWaits = Summary();
+    mSpends = Summary();
+}
+
+// Service entity stats of the packet arrived at t, served from begin and
+// finished now. The idle time is the time from the previous departure
+// of the station to begin, if later. The debug output goes to trace.
+void Service::stats (double t, double begin, double now, Tee& trace) {
+    mArrivalTime = t;
+    mTimeServiceBegin = begin;
+    mTimePktWaitsInQueue = begin - t;
+    if (begin > mTimeServiceEnd) {
+        mIdleTimeOfService = begin - mTimeServiceEnd;
+    } else {
+        mIdleTimeOfService = 0;
+    }
+
+    mTimeServiceEnd = now;
+    mServiceTime = mTimeServiceEnd - mTimeServiceBegin;
+    mTimePktSpendsInSystem = mServiceTime + mTimePktWaitsInQueue;
+
+    mTotalServiceTime += mServiceTime;
+    mTotalPacket++;
+    mServiceTimes.Add(mServiceTime);
+    mWaits.Add(mTimePktWaitsInQueue);
+    mSpends.Add(mTimePktSpendsInSystem);
+
+    if (TRACING && dFlag > 1) {
+        trace << "ArrivalTime=" << mArrivalTime << " "
+              << "TimeServiceBegin=" << mTimeServiceBegin << " "
+              << "ServiceTime=" << mServiceTime << " "
+              << "TimeServiceEnd=" << mTimeServiceEnd << " "
+              << "TimePktWaitsInQueue=" << mTimePktWaitsInQueue << " "
+              << "TimePktSpendsInSystem=" << mTimePktSpendsInSystem << " "
+              << "IdleTimeOfService=" << mIdleTimeOfService << " "
+        ;
+    }
+}
+
+//---------------------------------------------------------------------------
+// Network topology
+//---------------------------------------------------------------------------
+
+// A network is made of sources, which generate packets of one class, and
+// stations, each a Service entity with its own PacketQueue. A station
+// routes every packet class it serves to the next station, or out of the
+// network. Sources and stations are numbered in the order they are
+// declared: source i raises B-event i (arrival), station j raises B-event
+// (number of sources + j) (departure).
+//
+// Topology file format, one declaration per line, '#' starts a comment:
+//   source <class> <interarrival time> <station>
+//   source <class> trace <packet log> <station>
+//   station <name> <service time>
+//   route <station> <class> <next station | out>
+//   queue <station> <capacity> [drop | red <min> <max> <maxp> | block]
+//   servers <station> <number>
+//   discipline <station> fifo | ps | priority <class>...
+//                      | wfq <class> <weight>...
+// where a time is one of
+//   exp <mean>
+//   rate <rate>             (exponential of mean 1 / rate)
+//   normal <mean> <sigma>
+//   fixed <value>
+//   bytes <rate>            (service time of a packet of the log: its
+//                            size over the rate in bytes per second)
+// optionally followed by "min <value>": samples below the minimum (0 by
+// default) are drawn again. A class without a route at a station leaves
+// the network there.
+//
+// A trace source replays the arrivals recorded in a packet log (see
+// PacketLog) rather than drawing them, and stops at its end.
+//
+// A queue declaration bounds the packets at a station, the one in service
+// included. A packet arriving at the full queue is dropped (drop, the
+// default), a packet arriving at a RED queue may be dropped before (red,
+// optionally followed by "weight <value>"), or the packet is held where
+// it comes from until there is room (block): a station keeps it in
+// service, blocked, and a source stops generating.
+//
+// A station has one server unless declared with more; a waiting packet
+// goes to the first server free. It serves the waiting packets first in
+// first out (fifo, the default); by class (priority), the classes listed
+// first, then the others in the order they were declared; or by weighted
+// fair queueing (wfq), a class getting a share of the servers in
+// proportion to its weight (1 unless listed). Neither interrupts the
+// packets in service. Under processor sharing (ps) every packet at the
+// station is in service, each at the rate of one server while there are
+// enough of them, sharing them equally otherwise.
+
+// Built-in topology, the network of the diagram. Its B-events are:
+//   B1: arrival, Px arrives and enters router queue.
+//   B2: arrival, Py arrives and enters router queue.
+//   B3: departure, router completes work and outputs
+//       Px to S1 queue, Py to S2 queue.
+//   B4: departure, S1 completes work and packet leave the network
+//       (increment packets served Px by 1).
+//   B5: departure, S2 completes work and packet leave the network
+//       (increment packets served Py by 1).
+const string DEFAULT_TOPOLOGY =
+"source Px exp 5 R\n"
+"source Py exp 10 R\n"
+"station R normal 1 0.6\n"
+"station S1 normal 4 0.6\n"
+"station S2 normal 7 0.6\n"
+"route R Px S1\n"
+"route R Py S2\n";
+
+// Packet in service at a station
+class Job {
+public:
+    Packet packet_;
+    double begin_; // time the service began
+    // Time the service ends, or the time it ended if blocked; under
+    // processor sharing the work left instead, while not blocked
+    double end_;
+    double work_; // service time drawn
+    bool blocked_; // finished, held for a full blocking queue
+};
+
+// Packet source
+class Source {
+public:
+    int class_; // class of the packets generated
+    Distribution interArrival_; // interarrival time
+    VariateBuffer variates_; // interarrival times
+    int station_; // station the packets enter
+    int lp_; // logical process running the source
+    Packet held_; // packet held while blocked by the full station
+    double blockedSince_; // time the source was blocked
+    PacketLog log_; // arrivals replayed by a trace source
+    double size_; // size of the next packet of the log
+};
+
+// Station: a Service entity with its packet queue and routing
+class Station {
+public:
+    // What becomes of a packet arriving at the full queue
+    enum Policy { DROP_TAIL, RED, BLOCK };
+    // Order of service of the waiting packets
+    enum Discipline { FIFO, PRIORITY, WFQ, PS };
+
+    string name_;
+    Service service_;
+    PacketQueue queue_;
+    Distribution serviceTime_;
+    VariateBuffer variates_; // service times
+    vector<int> routes_; // next station per class, or Network::OUT
+    vector<size_t> served_; // packets served per class
+    vector<size_t> exits_; // packets leaving the network per class
+    vector<Summary> sojourns_; // times in network of those packets
+    vector<bool> visits_; // classes reaching the station
+    int lp_; // logical process running the station
+    bool cross_; // routes packets to another logical process
+    double departure_; // time of the first departure scheduled while busy
+    int servers_; // packets served at once
+    Discipline discipline_;
+    vector<int> ranks_; // priority of each class, the lowest first
+    vector<double> weights_; // WFQ weight of each class
+    vector<double> finish_; // WFQ finish tag of the last packet per class
+    double virtual_; // WFQ virtual time, the tag of the last one served
+    double shared_; // time the PS work left was last brought up to date
+    vector<Job> serving_; // packets in service
+    vector<Summary> classWaits_; // waits in queue per class, by priority
+                                 // or WFQ
+    Policy policy_; // of a finite queue
+    Red red_; // drop decisions of a RED queue
+    RandomStream dropStream_; // substream of the RED drops, or of the
+                              // waits of an analytic station
+    vector<size_t> offered_; // packets arriving at the queue per class
+    vector<size_t> drops_; // packets dropped per class
+    // Stations (j) and sources (-1 - i) holding a packet for the full
+    // queue, in the order they were blocked
+    std::deque<int> blocked_;
+    Moments blocking_; // times packets were held for the full queue
+    bool analytic_; // served by its queueing model, not simulated
+    double load_; // utilization offered, from the topology
+    double wait_; // mean wait in queue of the model
+    double error_; // that wait less the one for the arrivals estimated
+};
+
+// Network of sources and stations
+class Network {
+public:
+    static const int OUT = -1; // route out of the network
+    // Sources or stations at most: an event keeps 16 bits for the entity,
+    // a trace record 15 for the station
+    static const size_t MAX_ENTITIES = 0x7fff;
+    // Queue capacity at most, a ring of it allocated per lane
+    static const long MAX_CAPACITY = 1 << 20;
+
+    Network () {}
+    ~Network () {}
+    bool Load (std::istream&, string&);
+    size_t Classes () const { return mClasses.size(); }
+    const string& ClassName (int c) const { return mClasses[c]; }
+    size_t Sources () const { return mSources.size(); }
+    Source& SourceAt (int i) { return mSources[i]; }
+    size_t Stations () const { return mStations.size(); }
+    Station& StationAt (int i) { return mStations[i]; }
+    const Station& StationAt (int i) const { return mStations[i]; }
+    size_t Exits (int) const;
+    size_t Partition (size_t);
+    size_t Hybrid (double);
+    bool Blocking () const;
+    int FindStation (const string&) const;
+
+    int EventNumber (int, int) const;
+
+private:
+    vector<string> mClasses;
+    vector<Source> mSources;
+    vector<Station> mStations;
+
+    int FindClass (const string&, bool);
+    void Visit (int, int);
+    bool ReadDiscipline (std::istream&, string&);
+};
+
+const int Network::OUT;
+const size_t Network::MAX_ENTITIES;
+const long Network::MAX_CAPACITY;
+
+// Return the B-event number of the debug output of an event of a type
+// about entity id: the sources, then the station departures, then the
+// packets passed to the stations from another logical process.
+int Network::EventNumber (int type, int id) const {
+    switch (type) {
+    case ARRIVAL: return id + 1;
+    case DEPARTURE: return Sources() + id + 1;
+    default: return Sources() + Stations() + id + 1;
+    }
+}
+
+// Return the index of a class, adding it if asked to
+int Network::FindClass (const string& name, bool add) {
+    for (size_t c = 0; c < mClasses.size(); c++) {
+        if (mClasses[c] == name) {
+            return c;
+        }
+    }
+    if (!add) {
+        return -1;
+    }
+    mClasses.push_back(name);
+    return mClasses.size() - 1;
+}
+
+// Return the index of a station, -1 if unknown
+int Network::FindStation (const string& name) const {
+    for (size_t j = 0; j < mStations.size(); j++) {
+        if (mStations[j].name_ == name) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+// Mark the stations a class goes through, starting at station j
+void Network::Visit (int c, int j) {
+    while (j != OUT && !mStations[j].visits_[c]) {
+        mStations[j].visits_[c] = true;
+        j = mStations[j].routes_[c];
+    }
+}
+
+// Return the number of packets of a class that left the network
+size_t Network::Exits (int c) const {
+    size_t total = 0;
+    for (size_t j = 0; j < mStations.size(); j++) {
+        total += mStations[j].exits_[c];
+    }
+    return total;
+}
+
+// Read "<station> <discipline>" of a discipline declaration, the classes
+// all known. On error returns false with a message in error.
+bool Network::ReadDiscipline (std::istream& in, string& error) {
+    string station, name;
+    int j;
+    if (!(in >> station >> name)) {
+        error = "bad discipline";
+        return false;
+    }
+    if ((j = FindStation(station)) < 0) {
+        error = "unknown station " + station;
+        return false;
+    }
+    Station& s = mStations[j];
+    s.ranks_.assign(mClasses.size(), 0);
+    s.weights_.assign(mClasses.size(), 1.0);
+    if (name == "fifo" || name == "ps") {
+        s.discipline_ = (name == "ps") ? Station::PS : Station::FIFO;
+        s.queue_.Lanes(1);
+        return true;
+    } else if (name == "priority") {
+        s.discipline_ = Station::PRIORITY;
+    } else if (name == "wfq") {
+        s.discipline_ = Station::WFQ;
+    } else {
+        error = "unknown discipline " + name;
+        return false;
+    }
+
+    // The classes listed, then the others in their order
+    vector<bool> listed(mClasses.size(), false);
+    int rank = 0;
+    string cls;
+    while (in >> cls) {
+        int c = FindClass(cls, false);
+        if (c < 0 || listed[c]) {
+            error = (c < 0 ? "unknown class " : "duplicate class ") + cls;
+            return false;
+        }
+        listed[c] = true;
+        s.ranks_[c] = rank++;
+        if (s.discipline_ == Station::WFQ
+                && (!(in >> s.weights_[c]) || s.weights_[c] <= 0)) {
+            error = "bad weight of " + cls;
+            return false;
+        }
+    }
+    for (size_t c = 0; c < mClasses.size(); c++) {
+        if (!listed[c]) {
+            s.ranks_[c] = rank++;
+        }
+    }
+    s.queue_.Lanes(mClasses.size());
+    return true;
+}
+
+// Return true if a full queue blocks the packets coming to it
+bool Network::Blocking () const {
+    for (size_t j = 0; j < mStations.size(); j++) {
+        if (mStations[j].policy_ == Station::BLOCK) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Serve by a queueing model the stations offered less than threshold
+// utilization by the rates of the sources, single FIFO servers with an
+// unbounded queue and no per-byte times, whose packets never block.
+// The model is M/G/1: a packet waits with probability the utilization,
+// then for an exponential time giving the Pollaczek-Khinchine mean wait.
+// Its error is estimated against the arrivals the station really gets,
+// as in QNA (Whitt, 1983): merging flows average the squared coefficient
+// of variation (scv) of their interarrival times, weighted by their
+// rates, a station of utilization rho passes on rho^2 scv(service) +
+// (1 - rho^2) scv(arrivals), and the mean wait goes as (scv(arrivals) +
+// scv(service)) / 2 in the Kingman approximation. Trace sources and
+// classes routed in a loop make their stations simulated. Returns the
+// number of analytic stations.
+size_t Network::Hybrid (double threshold) {
+    size_t n = mStations.size();
+    vector<vector<int> > paths(mSources.size());
+    vector<double> rates(mSources.size()), scvs(mSources.size());
+    vector<double> arrivals(n, 0.0);
+    for (size_t i = 0; i < mSources.size(); i++) {
+        const Source& src = mSources[i];
+        double mean = src.interArrival_.Mean();
+        int j = src.station_;
+        while (j != OUT && paths[i].size() <= n) {
+            paths[i].push_back(j);
+            j = mStations[j].routes_[src.class_];
+        }
+        bool known = !src.log_.IsOpen() && mean > 0 && j == OUT;
+        rates[i] = known ? 1 / mean : HUGE_VAL;
+        scvs[i] = known ? src.interArrival_.Variance() / (mean * mean) : 1;
+        for (size_t k = 0; k < paths[i].size(); k++) {
+            arrivals[paths[i][k]] += rates[i];
+        }
+    }
+
+    vector<double> service(n), scv(n, 1.0);
+    for (size_t j = 0; j < n; j++) {
+        Station& station = mStations[j];
+        double mean = station.serviceTime_.Mean();
+        station.load_ = arrivals[j] * mean / station.servers_;
+        service[j] = mean > 0 ? station.serviceTime_.Variance()
+                                / (mean * mean) : 0;
+    }
+    // Every pass carries the scv one station further down the paths
+    for (size_t pass = 0; pass < n; pass++) {
+        vector<double> sum(n, 0.0);
+        for (size_t i = 0; i < mSources.size(); i++) {
+            double c2 = scvs[i];
+            for (size_t k = 0; rates[i] < HUGE_VAL
+                               && k < paths[i].size(); k++) {
+                int j = paths[i][k];
+                double rho = std::min(mStations[j].load_, 1.0);
+                sum[j] += rates[i] * c2;
+                c2 = rho * rho * service[j] + (1 - rho * rho) * scv[j];
+            }
+        }
+        for (size_t j = 0; j < n; j++) {
+            if (arrivals[j] > 0 && arrivals[j] < HUGE_VAL) {
+                scv[j] = sum[j] / arrivals[j];
+            }
+        }
+    }
+
+    size_t analytic = 0;
+    for (size_t j = 0; j < n; j++) {
+        Station& station = mStations[j];
+        double rho = station.load_;
+        if (rho < 1) {
+            station.wait_ = rho / (1 - rho) * station.serviceTime_.Mean()
+                          * (1 + service[j]) / 2;
+            station.error_ = station.wait_ * (1 - scv[j])
+                           / (1 + service[j]);
+        } else {
+            station.wait_ = station.error_ = HUGE_VAL;
+        }
+        station.analytic_ = rho < threshold && station.servers_ == 1
+                         && station.discipline_ == Station::FIFO
+                         && station.queue_.Capacity() == 0
+                         && !station.serviceTime_.PerByte();
+        for (size_t c = 0; c < station.routes_.size(); c++) {
+            int next = station.routes_[c];
+            if (next != OUT && mStations[next].policy_ == Station::BLOCK) {
+                station.analytic_ = false;
+            }
+        }
+        analytic += station.analytic_;
+    }
+    return analytic;
+}
+
+// Split the stations into n logical processes of consecutive stations,
+// each source going with its station. Returns the number of logical
+// processes, at most one per station.
+size_t Network::Partition (size_t n) {
+    n = std::max((size_t) 1, std::min(n, mStations.size()));
+    for (size_t j = 0; j < mStations.size(); j++) {
+        mStations[j].lp_ = j * n / mStations.size();
+    }
+    for (size_t j = 0; j < mStations.size(); j++) {
+        Station& station = mStations[j];
+        station.cross_ = false;
+        for (size_t c = 0; c < station.routes_.size(); c++) {
+            int next = station.routes_[c];
+            if (next != OUT && mStations[next].lp_ != station.lp_) {
+                station.cross_ = true;
+            }
+        }
+    }
+    for (size_t i = 0; i < mSources.size(); i++) {
+        mSources[i].lp_ = mStations[mSources[i].station_].lp_;
+    }
+    return n;
+}
+
+// Read a topology. Stations are declared first, so sources and routes
+// may refer to stations declared further down, and disciplines last,
+// once the classes are known. On error returns false with a message in
+// error.
+bool Network::Load (std::istream& in, string& error) {
+    vector<string> lines;
+    string line;
+    while (std::getline(in, line)) {
+        lines.push_back(line.substr(0, line.find('#')));
+    }
+
+    for (int pass = 0; pass < 3; pass++) {
+        for (size_t n = 0; n < lines.size(); n++) {
+            istringstream iss(lines[n]);
+            string keyword, name, next;
+            std::ostringstream where;
+            where << "line " << n + 1 << ": ";
+            if (!(iss >> keyword)) {
+                continue; // blank line
+            }
+
+            if (keyword == "station") {
+                if (pass > 0) {
+                    continue;
+                }
+                Station s;
+                s.lp_ = 0;
+                s.cross_ = false;
+                s.departure_ = 0;
+                s.servers_ = 1;
+                s.discipline_ = Station::FIFO;
+                s.virtual_ = 0;
+                s.shared_ = 0;
+                s.policy_ = Station::DROP_TAIL;
+                s.analytic_ = false;
+                s.load_ = 0;
+                s.wait_ = 0;
+                s.error_ = 0;
+                if (!(iss >> s.name_) || !s.serviceTime_.Read(iss)) {
+                    error = where.str() + "bad station";
+                    return false;
+                }
+                if (FindStation(s.name_) >= 0 || s.name_ == "out") {
+                    error = where.str() + "duplicate station " + s.name_;
+                    return false;
+                }
+                mStations.push_back(s);
+            } else if (pass == 0) {
+                continue;
+            } else if (keyword == "discipline") {
+                if (pass < 2) {
+                    continue;
+                }
+                if (!ReadDiscipline(iss, error)) {
+                    error = where.str() + error;
+                    return false;
+                }
+            } else if (pass == 2) {
+                continue;
+            } else if (keyword == "source") {
+                Source src;
+                string log;
+                std::streampos pos;
+                if (!(iss >> name) || (pos = iss.tellg()) < 0
+                                   || !(iss >> log)) {
+                    error = where.str() + "bad source";
+                    return false;
+                }
+                if (log == "trace") {
+                    if (!(iss >> log >> next)) {
+                        error = where.str() + "bad source";
+                        return false;
+                    }
+                    if (!src.log_.Open(log, error)) {
+                        error = where.str() + error;
+                        return false;
+                    }
+                } else if (!iss.seekg(pos) || !src.interArrival_.Read(iss)
+                                           || !(iss >> next)) {
+                    error = where.str() + "bad source";
+                    return false;
+                }
+                if ((src.station_ = FindStation(next)) < 0) {
+                    error = where.str() + "unknown station " + next;
+                    return false;
+                }
+                src.class_ = FindClass(name, true);
+                src.lp_ = 0;
+                src.blockedSince_ = 0;
+                src.size_ = 0;
+                mSources.push_back(src);
+            } else if (keyword == "route") {
+                string station, cls;
+                if (!(iss >> station >> cls >> next)) {
+                    error = where.str() + "bad route";
+                    return false;
+                }
+                int j = FindStation(station);
+                int k = (next == "out") ? OUT : FindStation(next);
+                if (j < 0 || (k == OUT && next != "out")) {
+                    error = where.str() + "unknown station "
+                                        + (j < 0 ? station : next);
+                    return false;
+                }
+                int c = FindClass(cls, true);
+                if (mStations[j].routes_.size() <= (size_t) c) {
+                    mStations[j].routes_.resize(c + 1, OUT);
+                }
+                mStations[j].routes_[c] = k;
+            } else if (keyword == "queue") {
+                string station, policy = "drop";
+                long capacity;
+                int j;
+                if (!(iss >> station >> capacity) || capacity < 1
+                        || capacity > MAX_CAPACITY) {
+                    error = where.str() + "bad queue";
+                    return false;
+                }
+                if ((j = FindStation(station)) < 0) {
+                    error = where.str() + "unknown station " + station;
+                    return false;
+                }
+                Station& s = mStations[j];
+                iss >> policy;
+                if (policy == "drop") {
+                    s.policy_ = Station::DROP_TAIL;
+                } else if (policy == "red" && s.red_.Read(iss)) {
+                    s.policy_ = Station::RED;
+                } else if (policy == "block") {
+                    s.policy_ = Station::BLOCK;
+                } else {
+                    error = where.str() + "bad queue policy";
+                    return false;
+                }
+                s.queue_.Capacity(capacity);
+            } else if (keyword == "servers") {
+                string station;
+                int servers, j;
+                if (!(iss >> station >> servers) || servers < 1) {
+                    error = where.str() + "bad servers";
+                    return false;
+                }
+                if ((j = FindStation(station)) < 0) {
+                    error = where.str() + "unknown station " + station;
+                    return false;
+                }
+                mStations[j].servers_ = servers;
+            } else {
+                error = where.str() + "unknown keyword " + keyword;
+                return false;
+            }
+
+            // Nothing may follow a declaration
+            if (iss >> next) {
+                error = where.str() + "bad " + keyword;
+                return false;
+            }
+        }
+    }
+
+    if (mSources.empty()) {
+        error = "no source";
+        return false;
+    }
+    if (mSources.size() > MAX_ENTITIES || mStations.size() > MAX_ENTITIES) {
+        error = "too many sources or stations";
+        return false;
+    }
+    for (size_t j = 0; j < mStations.size(); j++) {
+        mStations[j].routes_.resize(mClasses.size(), OUT);
+        mStations[j].served_.assign(mClasses.size(), 0);
+        mStations[j].exits_.assign(mClasses.size(), 0);
+        mStations[j].sojourns_.assign(mClasses.size(), Summary());
+        mStations[j].visits_.assign(mClasses.size(), false);
+        mStations[j].offered_.assign(mClasses.size(), 0);
+        mStations[j].drops_.assign(mClasses.size(), 0);
+        mStations[j].classWaits_.assign(mClasses.size(), Summary());
+        mStations[j].ranks_.resize(mClasses.size(), 0);
+        mStations[j].weights_.resize(mClasses.size(), 1.0);
+        mStations[j].finish_.assign(mClasses.size(), 0.0);
+    }
+    for (size_t i = 0; i < mSources.size(); i++) {
+        Visit(mSources[i].class_, mSources[i].station_);
+    }
+    for (size_t j = 0; j < mStations.size(); j++) {
+        if (!mStations[j].serviceTime_.PerByte()) {
+            continue;
+        }
+        for (size_t i = 0; i < mSources.size(); i++) {
+            const Source& src = mSources[i];
+            if (mStations[j].visits_[src.class_] && !src.log_.Sizes()) {
+                error = "station " + mStations[j].name_ + " needs the"
+                        " sizes of class " + mClasses[src.class_];
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------------
+// Binary trace
+//---------------------------------------------------------------------------
+
+// One line of the packet log: a station finishing a packet. The service
+// time, the wait in queue and the time spent are derived from these
+// fields as in Service::stats.
+struct TraceRecord {
+    double arrival_; // arrival time at the station
+    double begin_; // time service began
+    double end_; // time service ended
+    double idle_; // idle time of the station before the service
+    uint32_t no_; // packets entered the network so far
+    uint16_t station_; // station, ENTRY set on the first station
+    uint16_t class_; // packet class
+    static const uint16_t ENTRY = 0x8000;
+};
+
+const uint16_t TraceRecord::ENTRY;
+
+// Trace file header line
+const string TRACE_MAGIC = "SimComplex trace 1";
+
+// Writes trace records to a file through a ring of blocks. The run fills
+// one block while a background thread writes the full ones, so writing a
+// record costs a copy, and the run only waits if the ring is full.
+// The file starts with a text header: the magic line, the station and
+// class counts, then one name per line; the records follow.
+class TraceWriter {
+public:
+    TraceWriter ();
+    ~TraceWriter () { Close(); }
+    bool Open (const string&, const Network&);
+    void Write (const TraceRecord& record) {
+        if (mCount == BLOCK_RECORDS) {
+            Flip();
+        }
+        mBlock[mCount++] = record;
+    }
+    void Close ();
+
+private:
+    static const size_t BLOCK_RECORDS = 4096; // records per block
+    static const size_t BLOCKS = 4; // blocks in the ring
+
+    vector<TraceRecord> mRing;
+    TraceRecord* mBlock; // block being filled
+    size_t mCount; // records in it
+    size_t mCurrent; // its index
+
+    std::ofstream mFile;
+    std::thread mThread;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    queue<std::pair<size_t, size_t> > mFull; // blocks to write, and sizes
+    vector<bool> mBusy; // blocks not written yet
+    bool mClosing;
+
+    void Flip ();
+    void Writer ();
+
+    TraceWriter (const TraceWriter&);
+    TraceWriter& operator= (const TraceWriter&);
+};
+
+const size_t TraceWriter::BLOCK_RECORDS;
+const size_t TraceWriter::BLOCKS;
+
+// Constructor
+TraceWriter::TraceWriter ()
+    : mRing(BLOCKS * BLOCK_RECORDS), mBlock(&mRing[0]), mCount(0),
+      mCurrent(0), mBusy(BLOCKS, false), mClosing(false) {
+}
+
+// Create the trace file of the network and start the writer thread
+bool TraceWriter::Open (const string& name, const Network& network) {
+    mFile.open(name.c_str(), std::ios::binary);
+    if (!mFile) {
+        return false;
+    }
+    mFile << TRACE_MAGIC << "\n"
+          << network.Stations() << " " << network.Classes() << "\n";
+    for (size_t j = 0; j < network.Stations(); j++) {
+        mFile << network.StationAt(j).name_ << "\n";
+    }
+    for (size_t c = 0; c < network.Classes(); c++) {
+        mFile << network.ClassName(c) << "\n";
+    }
+    mThread = std::thread(&TraceWriter::Writer, this);
+    return true;
+}
+
+// Hand the full block to the writer and go on with the next one
+void TraceWriter::Flip () {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mBusy[mCurrent] = true;
+    mFull.push(std::make_pair(mCurrent, mCount));
+    mCondition.notify_all();
+
+    mCurrent = (mCurrent + 1) % BLOCKS;
+    while (mBusy[mCurrent]) {
+        mCondition.wait(lock);
+    }
+    mBlock = &mRing[mCurrent * BLOCK_RECORDS];
+    mCount = 0;
+}
+
+// Background thread writing the full blocks
+void TraceWriter::Writer () {
+    std::unique_lock<std::mutex> lock(mMutex);
+    for (;;) {
+        while (mFull.empty() && !mClosing) {
+            mCondition.wait(lock);
+        }
+        if (mFull.empty()) {
+            return;
+        }
+        std::pair<size_t, size_t> block = mFull.front();
+        mFull.pop();
+
+        lock.unlock();
+        mFile.write(reinterpret_cast<const char*>(
+                        &mRing[block.first * BLOCK_RECORDS]),
+                    block.second * sizeof(TraceRecord));
+        lock.lock();
+
+        mBusy[block.first] = false;
+        mCondition.notify_all();
+    }
+}
+
+// Write what is left and close the file
+void TraceWriter::Close () {
+    if (!mThread.joinable()) {
+        return;
+    }
+    if (mCount > 0) {
+        Flip();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mClosing = true;
+        mCondition.notify_all();
+    }
+    mThread.join();
+    mFile.close();
+}
+
+// Convert a trace file to the CSV packet log on out. Returns false if
+// the file is not a trace.
+bool ConvertTrace (const string& name, ostream& out) {
+    std::ifstream in(name.c_str(), std::ios::binary);
+    string line;
+    size_t stations, classes;
+    if (!std::getline(in, line) || line != TRACE_MAGIC
+                                || !(in >> stations >> classes)) {
+        return false;
+    }
+    std::getline(in, line);
+    vector<string> stationNames(stations), classNames(classes);
+    for (size_t j = 0; j < stations; j++) {
+        std::getline(in, stationNames[j]);
+    }
+    for (size_t c = 0; c < classes; c++) {
+        std::getline(in, classNames[c]);
+    }
+    if (!in) {
+        return false;
+    }
+
+    out << "router,no,type,arrival,begin,service time,"
+        << "end,wait in q,spend,idle \\ \n"
+        << "  server type,no,type,arrival,begin,service time,"
+        << "end,wait in q,spend,idle\n";
+
+    TraceRecord record;
+    while (in.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+        size_t j = record.station_ & ~TraceRecord::ENTRY;
+        if (j >= stations || record.class_ >= classes) {
+            return false;
+        }
+        if (record.station_ & TraceRecord::ENTRY) {
+            out << "\n";
+        }
+        double serviceTime = record.end_ - record.begin_;
+        double waitInQueue = record.begin_ - record.arrival_;
+        out << stationNames[j] << "," << record.no_ << ","
+            << classNames[record.class_] << ","
+            << record.arrival_ << ","
+            << record.begin_ << ","
+            << serviceTime << ","
+            << record.end_ << ","
+            << waitInQueue << ","
+            << serviceTime + waitInQueue << ","
+            << record.idle_ << " "
+            << " ";
+    }
+    out << "\n";
+    return true;
+}
+
+//---------------------------------------------------------------------------
+// Helper for collecting and reporting statistics
+//---------------------------------------------------------------------------
+
+class Stats {
+private:
+    size_t mTotalArrivals;
+    double mTotalWaitingTime;
+    // Gaps between the arrivals of each class in the network
+    vector<Moments> mInterArrivals;
+    // Time of the last arrival of each class
+    vector<double> mLastArrival;
+    double mWarmUp; // time the stats were reset after the warm-up
+public:
+    Stats (size_t);
+    ~Stats () {}
+    void IncrementArrivals () { mTotalArrivals += 1; };
+    size_t TotalArrivals () const { return mTotalArrivals; }
+    void ComputeTotalWaitingTime (double interval) {
+        mTotalWaitingTime += interval;
+    };
+    double TotalWaitingTime () const { return mTotalWaitingTime; }
+    void RecordArrival (int, double);
+    const Moments& InterArrivals (int c) const {
+        return mInterArrivals[c];
+    }
+    double WarmUp () const { return mWarmUp; }
+    void Reset (double);
+    void Merge (const Stats&);
+    void Save (ostream&) const;
+    bool Load (std::istream&);
+};
+
+// Constructor
+Stats::Stats (size_t classes) {
+    mTotalArrivals = 0;
+    mTotalWaitingTime = 0;
+    mInterArrivals.assign(classes, Moments());
+    mLastArrival.assign(classes, 0.0);
+    mWarmUp = 0;
+}
+
+// Restart the stats at time now, the end of the warm-up. The arrival
+// count goes on, as it numbers the packets of the trace.
+void Stats::Reset (double now) {
+    mTotalWaitingTime = 0;
+    mInterArrivals.assign(mInterArrivals.size(), Moments());
+    mWarmUp = now;
+}
+
+// Record the arrival of a packet of class c in the network at time now;
+// the first gap is counted from time 0
+void Stats::RecordArrival (int c, double now) {
+    mInterArrivals[c].Add(now - mLastArrival[c]);
+    mLastArrival[c] = now;
+}
+
+// Save the stats
+void Stats::Save (ostream& out) const {
+    Put(out, mTotalArrivals);
+    Put(out, mTotalWaitingTime);
+    Put(out, mInterArrivals);
+    Put(out, mLastArrival);
+    Put(out, mWarmUp);
+}
+
+// Load the stats
+bool Stats::Load (std::istream& in) {
+    return Get(in, mTotalArrivals) && Get(in, mTotalWaitingTime)
+        && Get(in, mInterArrivals) && Get(in, mLastArrival)
+        && Get(in, mWarmUp);
+}
+
+// Add the stats of another logical process of the same run. Gaps are
+// per LP, so sources of one class on several LPs are not interleaved.
+void Stats::Merge (const Stats& other) {
+    mTotalArrivals += other.mTotalArrivals;
+    mTotalWaitingTime += other.mTotalWaitingTime;
+    for (size_t c = 0; c < mInterArrivals.size(); c++) {
+        mInterArrivals[c].Merge(other.mInterArrivals[c]);
+        mLastArrival[c] = std::max(mLastArrival[c], other.mLastArrival[c]);
+    }
+    mWarmUp = std::max(mWarmUp, other.mWarmUp);
+}
+
+// One performance metric of a run, as shown in the report
+class Metric {
+public:
+    string name_;
+    double value_;
+    const char* unit_; // appended to the value, " sec", " packets" or ""
+    int station_; // station the metric is about, -1 if none
+    Metric (const string& name, double value, const char* unit, int station)
+        : name_(name), value_(value), unit_(unit), station_(station) {}
+};
+
+//---------------------------------------------------------------------------
+// Engine statistics
+//---------------------------------------------------------------------------
+
+// Counters of the simulation engine over a run (--engine-stats): events
+// and wall time per event type, FEL size and heap allocations
+class EngineStats {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    EngineStats ();
+    void Start ();
+    void Stop ();
+    void Record (int type, size_t size, Clock::duration spent) {
+        mEvents[type]++;
+        mSpent[type] += spent;
+        mSizes += size;
+        mPeakSize = std::max(mPeakSize, size);
+    }
+    void Report (std::ostream&) const;
+
+private:
+    static const int TYPES = TRANSFER + 1;
+    size_t mEvents[TYPES]; // events dispatched per type
+    Clock::duration mSpent[TYPES]; // time in the handler per type
+    size_t mSizes; // sum of the FEL sizes after each event
+    size_t mPeakSize; // largest FEL size
+    Clock::time_point mStart; // wall clock at the start of the run
+    Clock::duration mWall; // wall time of the run
+    size_t mAllocations; // heap allocations during the run
+};
+
+// Constructor
+EngineStats::EngineStats ()
+    : mSizes(0), mPeakSize(0), mWall(0), mAllocations(0) {
+    for (int t = 0; t < TYPES; t++) {
+        mEvents[t] = 0;
+        mSpent[t] = Clock::duration(0);
+    }
+}
+
+// Start the wall clock and the allocation count of the run
+void EngineStats::Start () {
+    mAllocations = tAllocations;
+    mStart = Clock::now();
+}
+
+// Stop them at the end of the run
+void EngineStats::Stop () {
+    mWall = Clock::now() - mStart;
+    mAllocations = tAllocations - mAllocations;
+}
+
+// Write the report of the counters
+void EngineStats::Report (std::ostream& out) const {
+    static const char* const NAMES[TYPES] = {
+        "Arrival", "Departure", "Transfer"
+    };
+    size_t events = 0;
+    for (int t = 0; t < TYPES; t++) {
+        events += mEvents[t];
+    }
+    double wall = std::chrono::duration<double>(mWall).count();
+
+    out << "Engine statistics:\n"
+        << "========================================================="
+        << "\n\n"
+        << "Events processed = " << events << "\n"
+        << "Wall time = " << wall << " sec\n"
+        << "Events per second = " << (wall > 0 ? events / wall : 0.0)
+        << "\n"
+        << "Peak FEL size = " << mPeakSize << " events\n"
+        << "Mean FEL size = "
+        << (events > 0 ? (double) mSizes / events : 0.0) << " events\n"
+        << "Heap allocations = " << mAllocations << "\n";
+    for (int t = 0; t < TYPES; t++) {
+        double spent = std::chrono::duration<double>(mSpent[t]).count();
+        out << NAMES[t] << " handler = " << mEvents[t] << " events, "
+            << (mEvents[t] > 0 ? spent * 1e9 / mEvents[t] : 0.0)
+            << " ns per event, " << (wall > 0 ? 100 * spent / wall : 0.0)
+            << "% of the wall time\n";
+    }
+    out << "\n";
+}
+
+//---------------------------------------------------------------------------
+// Event Handlers
+//---------------------------------------------------------------------------
+
+// The handlers are plain classes: Simulation::Step calls the one of the
+// event type directly.
+
+class Simulation;
+
+class DepartureHandler {
+public:
+    DepartureHandler (Simulation& sim) : mSim(sim) {}
+    ~DepartureHandler ();
+    void handle (const Event&);
+    bool Free (int) const;
+    void Serve (int);
+    bool Admit (int, const Packet&);
+    void Join (int, Packet&);
+    void Enter (int, const Packet&);
+    void Pass (int, Packet&);
+    void Unblock (int);
+private:
+    Simulation& mSim; // the run the handler belongs to
+
+    int Pick (int) const;
+    double Rate (int) const;
+    void Share (int);
+    void Reschedule (int);
+    void NextService (int);
+    void Finish (int, const Packet&, double, double);
+    void Forward (int, Packet&, double);
+    void Release (int, int);
+};
+
+class ArrivalHandler {
+public:
+    ArrivalHandler (Simulation& sim) : mSim(sim) {}
+    ~ArrivalHandler ();
+    void handle (const Event&);
+    void ScheduleArrival (int);
+private:
+    Simulation& mSim; // the run the handler belongs to
+};
+
+// Packet arriving from another logical process
+class TransferHandler {
+public:
+    TransferHandler (Simulation& sim) : mSim(sim) {}
+    ~TransferHandler () {}
+    void handle (const Event&);
+private:
+    Simulation& mSim; // the run the handler belongs to
+};
+
+// Packet passed to a station of another logical process
+class Transfer {
+public:
+    double time_; // arrival time at the station
+    int station_;
+    int class_;
+    int hops_;
+    double entry_; // arrival time in the network
+    double size_; // bytes, given by the packet log
+};
+
+//---------------------------------------------------------------------------
+// Time series
+//---------------------------------------------------------------------------
+
+// Time series file of a run sampled with --sample
+const string SAMPLES_FILE = "samples.csv";
+
+// Metrics of every station sampled at fixed intervals of simulated time
+// (--sample): the packets at the station and the fraction of its servers
+// busy at the sample time, and the packets it served per second since
+// the previous sample. The run only compares the time of each event
+// with the next sample time; the samples go into one array per column,
+// reserved for the length of the run, and are written out at its end.
+class Sampler {
+public:
+    static const size_t MAX_RESERVED = 1 << 20; // samples reserved at most
+    Sampler () : mInterval(0), mNext(HUGE_VAL) {}
+    void Start (double, double, size_t, const Network&);
+    double Interval () const { return mInterval; }
+    double Next () const { return mNext; }
+    void Record (double, const Network&);
+    bool Write (const string&, const Network&) const;
+    void Save (ostream&) const;
+    bool Load (std::istream&, const Network&);
+
+private:
+    static size_t Served (const Station&);
+
+    double mInterval; // simulated time between samples, 0 if none
+    double mNext; // time of the next sample
+    vector<double> mTimes;
+    vector<vector<double> > mQueues; // per station, packets at it
+    vector<vector<double> > mBusy; // per station, servers busy
+    vector<vector<double> > mThroughputs; // per station, packets served
+                                          // per second
+    vector<size_t> mServed; // per station, packets served at the last
+                            // sample
+};
+
+const size_t Sampler::MAX_RESERVED;
+
+// Return the packets served by station
+size_t Sampler::Served (const Station& station) {
+    size_t served = 0;
+    for (size_t c = 0; c < station.served_.size(); c++) {
+        served += station.served_[c];
+    }
+    return served;
+}
+
+// Sample the stations of network every interval from now, with room for
+// n samples
+void Sampler::Start (double interval, double now, size_t n,
+                     const Network& network) {
+    n = std::min(n, MAX_RESERVED);
+    mInterval = interval;
+    mNext = (floor(now / interval) + 1) * interval;
+    mTimes.reserve(n);
+    mQueues.assign(network.Stations(), vector<double>());
+    mBusy.assign(network.Stations(), vector<double>());
+    mThroughputs.assign(network.Stations(), vector<double>());
+    for (size_t j = 0; j < network.Stations(); j++) {
+        mQueues[j].reserve(n);
+        mBusy[j].reserve(n);
+        mThroughputs[j].reserve(n);
+    }
+    mServed.resize(network.Stations());
+    for (size_t j = 0; j < network.Stations(); j++) {
+        mServed[j] = Served(network.StationAt(j));
+    }
+}
+
+// Take the samples due before time, the state of the network having not
+// changed since them
+void Sampler::Record (double time, const Network& network) {
+    while (mNext < time) {
+        mTimes.push_back(mNext);
+        for (size_t j = 0; j < network.Stations(); j++) {
+            const Station& station = network.StationAt(j);
+            size_t served = Served(station);
+            if (served < mServed[j]) {
+                mServed[j] = 0; // reset by the end of the warm-up
+            }
+            size_t busy = std::min(station.serving_.size(),
+                                   (size_t) station.servers_);
+            mQueues[j].push_back(station.queue_.QueueSize());
+            mBusy[j].push_back((double) busy / station.servers_);
+            mThroughputs[j].push_back((served - mServed[j]) / mInterval);
+            mServed[j] = served;
+        }
+        mNext += mInterval;
+    }
+}
+
+// Write the samples as CSV, one line per sample time, to the file name
+bool Sampler::Write (const string& name, const Network& network) const {
+    ofstream out(name.c_str());
+    out << "time";
+    for (size_t j = 0; j < network.Stations(); j++) {
+        const string& station = network.StationAt(j).name_;
+        out << "," << station << " queue," << station << " busy,"
+            << station << " throughput";
+    }
+    out << "\n";
+    for (size_t k = 0; k < mTimes.size(); k++) {
+        out << mTimes[k];
+        for (size_t j = 0; j < mQueues.size(); j++) {
+            out << "," << mQueues[j][k] << "," << mBusy[j][k] << ","
+                << mThroughputs[j][k];
+        }
+        out << "\n";
+    }
+    out.close();
+    return static_cast<bool>(out);
+}
+
+// Save the samples taken so far
+void Sampler::Save (ostream& out) const {
+    Put(out, mInterval);
+    Put(out, mNext);
+    Put(out, mTimes);
+    for (size_t j = 0; j < mQueues.size(); j++) {
+        Put(out, mQueues[j]);
+        Put(out, mBusy[j]);
+        Put(out, mThroughputs[j]);
+    }
+    Put(out, mServed);
+}
+
+// Load the samples of a run sampled on the same network, or nothing if
+// the run saved was not sampled
+bool Sampler::Load (std::istream& in, const Network& network) {
+    if (!Get(in, mInterval) || !Get(in, mNext) || !Get(in, mTimes)) {
+        return false;
+    }
+    size_t n = (mInterval > 0) ? network.Stations() : 0;
+    mQueues.assign(n, vector<double>());
+    mBusy.assign(n, vector<double>());
+    mThroughputs.assign(n, vector<double>());
+    for (size_t j = 0; j < n; j++) {
+        if (!Get(in, mQueues[j]) || !Get(in, mBusy[j])
+                || !Get(in, mThroughputs[j])) {
+            return false;
+        }
+    }
+    return Get(in, mServed);
+}
+
+//---------------------------------------------------------------------------
+// Simulation run
+//---------------------------------------------------------------------------
+
+// Checkpoint file written every --checkpoint seconds of simulated time,
+// and its header line
+const string CHECKPOINT_FILE = "checkpoint.bin";
+const string CHECKPOINT_MAGIC = "SimComplex checkpoint 8";
+
+// Context of one run (replication): clock, scheduler, network state,
+// stats and random number stream. A traced run writes its debug output to
+// the console and output1.txt and its packet log to output2.txt; any
+// other run is silent.
+class Simulation {
+public:
+    Simulation (const Network&, const string&, uint64_t, size_t, bool,
+                int = 0);
+    ~Simulation () { delete trace_; }
+    void Start ();
+    void Schedule (int, int, double);
+    bool Step ();
+    void Dispatch (const Event&);
+    void Run (double, size_t);
+    void RunUntil (double, double);
+    void Receive (const Transfer&);
+    void Metrics (vector<Metric>&) const;
+    void Report ();
+    void Observe (double);
+    void Reset ();
+    void Seed (RandomStream);
+    void Antithetic ();
+    bool Save (const string&);
+    void Save (ostream&);
+    bool Load (const string&, string&);
+    bool Load (std::istream&);
+    void Sample (double, size_t);
+
+    double time_; // current simulation time
+    double lastEventTime_; // time of last event before the current one
+    double endTime_; // time the run ends at, HUGE_VAL until it runs
+    ofstream file1_; // output file for debugging
+    ostream null_; // discards the output of a silent run
+    Tee tee_; // console and output1.txt
+    TraceWriter* trace_; // packet log, output2.bin; NULL if silent
+    Scheduler scheduler_;
+    Network network_;
+    Stats stats_;
+    ArrivalHandler arrivalHandler_;
+    DepartureHandler departureHandler_;
+    TransferHandler transferHandler_;
+    int lp_; // logical process run, of a parallel run
+    vector<Transfer> outbox_; // packets sent to other logical processes
+    // Packets received from other logical processes per station, by time
+    vector<std::deque<Transfer> > inbox_;
+    WarmUp warmUp_; // warm-up detection (-w)
+    BatchMeans batchMeans_; // steady-state time in network
+    double precision_; // relative half width ending the run (-e), or 0
+    bool precise_; // the batch means reached the precision
+    EngineStats* engine_; // engine counters (--engine-stats), or NULL
+    double checkpoint_; // simulated time between checkpoints, or 0
+    double nextCheckpoint_; // time of the next checkpoint
+    bool resumed_; // loaded from a checkpoint, already started
+    Sampler sampler_; // time series (--sample)
+    double nextSample_; // time of its next sample, HUGE_VAL if none
+
+private:
+    Simulation (const Simulation&);
+    Simulation& operator= (const Simulation&);
+};
+
+// Constructor, the run works on its own copy of the network.
+// Replication k of the seed draws from substream k of its stream.
+// A logical process of a parallel run only runs the sources and
+// stations of the network partitioned to it.
+Simulation::Simulation (const Network& network, const string& fel,
+                        uint64_t seed, size_t replication, bool trace,
+                        int lp)
+    : time_(0), lastEventTime_(0), endTime_(HUGE_VAL), null_(NULL),
+      tee_(trace ? cout : null_, trace ? file1_ : null_),
+      trace_(NULL),
+      network_(network),
+      stats_(network.Classes()),
+      arrivalHandler_(*this), departureHandler_(*this),
+      transferHandler_(*this), lp_(lp), inbox_(network.Stations()),
+      precision_(0), precise_(false), engine_(NULL), checkpoint_(0),
+      nextCheckpoint_(0), resumed_(false), nextSample_(HUGE_VAL) {
+    scheduler_.UseFEL(NewFEL(fel));
+
+    // Every source and station samples from its own substream
+    RandomStream stream(seed);
+    for (size_t k = 0; k < replication; k++) {
+        stream.LongJump();
+    }
+    Seed(stream);
+
+    if (trace) {
+        file1_.open("output1.txt");
+        trace_ = new TraceWriter;
+        if (!trace_->Open("output2.bin", network_)) {
+            delete trace_;
+            trace_ = NULL;
+        }
+    }
+}
+
+// Give every source and station its substream, one jump after the other
+// from stream
+void Simulation::Seed (RandomStream stream) {
+    for (size_t i = 0; i < network_.Sources(); i++) {
+        network_.SourceAt(i).variates_.Seed(stream);
+        stream.Jump();
+    }
+    for (size_t j = 0; j < network_.Stations(); j++) {
+        network_.StationAt(j).variates_.Seed(stream);
+        stream.Jump();
+    }
+    for (size_t j = 0; j < network_.Stations(); j++) {
+        network_.StationAt(j).dropStream_ = stream;
+        stream.Jump();
+    }
+}
+
+// Make every substream antithetic, before the run starts: the run then
+// draws 1 - u wherever the run of the same seed draws u
+void Simulation::Antithetic () {
+    for (size_t i = 0; i < network_.Sources(); i++) {
+        network_.SourceAt(i).variates_.Antithetic();
+    }
+    for (size_t j = 0; j < network_.Stations(); j++) {
+        network_.StationAt(j).variates_.Antithetic();
+        network_.StationAt(j).dropStream_.Antithetic();
+    }
+}
+
+// Put initial events in FEL
+void Simulation::Start () {
+    if (TRACING && dFlag) {
+        tee_ << "\n" << time_ << " (initialize simulation) ";
+    }
+
+    for (size_t i = 0; i < network_.Sources(); i++) {
+        if (network_.SourceAt(i).lp_ == lp_) {
+            arrivalHandler_.ScheduleArrival(i);
+        }
+    }
+}
+
+// Schedule an event of a type about entity id at time
+void Simulation::Schedule (int type, int id, double time) {
+    if (TRACING && dFlag) {
+        tee_ << "[" << "B" << network_.EventNumber(type, id) << " "
+             << time << "] ";
+    }
+    scheduler_.Schedule(type, id, time);
+}
+
+// Execute the imminent event. Returns false if there is none left: every
+// source keeps its next arrival scheduled, but a trace source stops at
+// the end of its log.
+bool Simulation::Step () {
+    // Remove the imminent B-event from FEL
+    Event e;
+    if (!scheduler_.Deque(e)) {
+        return false;
+    }
+
+    // Sample the state left by the events before
+    if (e.time_ > nextSample_) {
+        sampler_.Record(e.time_, network_);
+        nextSample_ = sampler_.Next();
+    }
+
+    // Advance simulation clock to its event time
+    time_ = e.time_;
+    if (TRACING && dFlag) {
+        tee_ << "\n" << time_ << " (Event B"
+             << network_.EventNumber(e.type_, e.id_) << ") ";
+    }
+
+    // Execute all B-type events that were removed from the FEL
+    if (engine_ == NULL) {
+        Dispatch(e);
+    } else {
+        EngineStats::Clock::time_point start = EngineStats::Clock::now();
+        Dispatch(e);
+        engine_->Record(e.type_, scheduler_.Size(),
+                        EngineStats::Clock::now() - start);
+    }
+    return true;
+}
+
+// Call the handler of the event type
+void Simulation::Dispatch (const Event& e) {
+    switch (e.type_) {
+    case ARRIVAL: arrivalHandler_.handle(e); break;
+    case DEPARTURE: departureHandler_.handle(e); break;
+    case TRANSFER: transferHandler_.handle(e); break;
+    }
+}
+
+// Take a packet passed by another logical process: it arrives at its
+// station by a transfer event. The inbox of the station is kept in the
+// order of the transfer events.
+void Simulation::Receive (const Transfer& t) {
+    std::deque<Transfer>& inbox = inbox_[t.station_];
+    std::deque<Transfer>::iterator it = inbox.end();
+    while (it != inbox.begin() && (it - 1)->time_ > t.time_) {
+        --it;
+    }
+    inbox.insert(it, t);
+    Schedule(TRANSFER, t.station_, t.time_);
+}
+
+// Run until endtime, or until endpx packets of the first class have left
+// the network, as selected by -t and -x
+void Simulation::Run (double endtime, size_t endpx) {
+    endTime_ = endtime;
+    if (engine_) {
+        engine_->Start();
+    }
+    if (!resumed_) {
+        Start();
+    }
+
+    while (Step()) {
+        if (checkpoint_ > 0 && time_ >= nextCheckpoint_) {
+            while (nextCheckpoint_ <= time_) {
+                nextCheckpoint_ += checkpoint_;
+            }
+            if (!Save(CHECKPOINT_FILE)) {
+                std::cerr << CHECKPOINT_FILE << ": cannot write\n";
+            }
+        }
+        if (precise_) {
+            break;
+        }
+        if (tFlag) {
+            if (time_ >= endtime) {
+                break;
+            }
+        } else if (xFlag) {
+            if (network_.Exits(0) == endpx) {
+                break;
+            }
+        } else {
+            if (time_ >= endtime || network_.Exits(0) == endpx) {
+                break;
+            }
+        }
+    }
+
+    if (engine_) {
+        engine_->Stop();
+    }
+    tee_ << "\n";
+    if (trace_) {
+        trace_->Close();
+    }
+    if (nextSample_ < HUGE_VAL && !sampler_.Write(SAMPLES_FILE, network_)) {
+        std::cerr << SAMPLES_FILE << ": cannot write\n";
+    }
+}
+
+// Observe the time in network x of a packet leaving the network: until
+// the warm-up is detected (-w), then in the batch means, which end the
+// run once precise enough (-e)
+void Simulation::Observe (double x) {
+    if (wFlag && !warmUp_.Done()) {
+        if (warmUp_.Add(x)) {
+            Reset();
+        }
+        return;
+    }
+    if (batchMeans_.Add(x) && precision_ > 0
+            && batchMeans_.Batches() >= BatchMeans::BATCHES) {
+        precise_ = batchMeans_.HalfWidth()
+                <= precision_ * fabs(batchMeans_.Mean());
+    }
+}
+
+// Restart the stats of the run at the end of the warm-up
+void Simulation::Reset () {
+    if (TRACING && dFlag) {
+        tee_ << "\n" << time_ << " (end of the warm-up) ";
+    }
+    stats_.Reset(time_);
+    for (size_t j = 0; j < network_.Stations(); j++) {
+        Station& station = network_.StationAt(j);
+        station.service_.Reset();
+        station.queue_.Reset(time_);
+        station.served_.assign(network_.Classes(), 0);
+        station.exits_.assign(network_.Classes(), 0);
+        station.sojourns_.assign(network_.Classes(), Summary());
+        station.offered_.assign(network_.Classes(), 0);
+        station.drops_.assign(network_.Classes(), 0);
+        station.blocking_ = Moments();
+        station.classWaits_.assign(network_.Classes(), Summary());
+    }
+}
+
+// Save the state of the run between two events into a checkpoint file,
+// written under another name first so that a crash leaves the previous
+// checkpoint whole
+bool Simulation::Save (const string& name) {
+    string temporary = name + ".tmp";
+    ofstream out(temporary.c_str(), std::ios::binary);
+    if (!out) {
+        return false;
+    }
+    out << CHECKPOINT_MAGIC << "\n" << network_.Sources() << " "
+        << network_.Stations() << " " << network_.Classes() << "\n";
+    for (size_t j = 0; j < network_.Stations(); j++) {
+        out << network_.StationAt(j).name_ << "\n";
+    }
+    for (size_t c = 0; c < network_.Classes(); c++) {
+        out << network_.ClassName(c) << "\n";
+    }
+    Save(out);
+    out.close();
+    return out && std::rename(temporary.c_str(), name.c_str()) == 0;
+}
+
+// Save the state of the run between two events
+void Simulation::Save (ostream& out) {
+    Put(out, time_);
+    Put(out, lastEventTime_);
+    Put(out, nextCheckpoint_);
+    Put(out, precise_);
+    scheduler_.Save(out);
+    stats_.Save(out);
+    warmUp_.Save(out);
+    batchMeans_.Save(out);
+    for (size_t i = 0; i < network_.Sources(); i++) {
+        const Source& source = network_.SourceAt(i);
+        source.variates_.Save(out);
+        Put(out, source.held_);
+        Put(out, source.blockedSince_);
+        Put(out, source.size_);
+        source.log_.Save(out);
+    }
+    for (size_t j = 0; j < network_.Stations(); j++) {
+        const Station& station = network_.StationAt(j);
+        Put(out, station.service_);
+        station.queue_.Save(out);
+        station.variates_.Save(out);
+        Put(out, station.served_);
+        Put(out, station.exits_);
+        Put(out, station.sojourns_);
+        Put(out, station.departure_);
+        Put(out, station.red_);
+        Put(out, station.dropStream_);
+        Put(out, station.offered_);
+        Put(out, station.drops_);
+        Put(out, vector<int>(station.blocked_.begin(),
+                             station.blocked_.end()));
+        Put(out, station.blocking_);
+        Put(out, station.serving_);
+        Put(out, station.classWaits_);
+        Put(out, station.finish_);
+        Put(out, station.virtual_);
+        Put(out, station.shared_);
+        Put(out, vector<Transfer>(inbox_[j].begin(), inbox_[j].end()));
+    }
+    sampler_.Save(out);
+}
+
+// Load the state of a run from a checkpoint file, before the run starts.
+// The network must have the same sources, stations and classes as the
+// one saved, but may differ in its times, to fork what-if runs.
+bool Simulation::Load (const string& name, string& error) {
+    std::ifstream in(name.c_str(), std::ios::binary);
+    string line;
+    size_t sources, stations, classes;
+    if (!std::getline(in, line) || line != CHECKPOINT_MAGIC
+                    || !(in >> sources >> stations >> classes)) {
+        error = "not a checkpoint";
+        return false;
+    }
+    std::getline(in, line);
+    bool same = (sources == network_.Sources()
+                 && stations == network_.Stations()
+                 && classes == network_.Classes());
+    for (size_t j = 0; same && j < stations; j++) {
+        same = std::getline(in, line) && line == network_.StationAt(j).name_;
+    }
+    for (size_t c = 0; same && c < classes; c++) {
+        same = std::getline(in, line) && line == network_.ClassName(c);
+    }
+    if (!same) {
+        error = "checkpoint of another network";
+        return false;
+    }
+    if (!Load(in)) {
+        error = "truncated checkpoint";
+        return false;
+    }
+    resumed_ = true;
+    return true;
+}
+
+// Load the state of a run saved by Save (ostream&). Returns false if
+// truncated.
+bool Simulation::Load (std::istream& in) {
+    bool ok = Get(in, time_) && Get(in, lastEventTime_)
+           && Get(in, nextCheckpoint_) && Get(in, precise_)
+           && scheduler_.Load(in) && stats_.Load(in) && warmUp_.Load(in)
+           && batchMeans_.Load(in);
+    for (size_t i = 0; ok && i < network_.Sources(); i++) {
+        Source& source = network_.SourceAt(i);
+        ok = source.variates_.Load(in) && Get(in, source.held_)
+          && Get(in, source.blockedSince_) && Get(in, source.size_)
+          && source.log_.Load(in);
+    }
+    for (size_t j = 0; ok && j < network_.Stations(); j++) {
+        Station& station = network_.StationAt(j);
+        vector<int> blocked;
+        vector<Transfer> inbox;
+        ok = Get(in, station.service_) && station.queue_.Load(in)
+          && station.variates_.Load(in) && Get(in, station.served_)
+          && Get(in, station.exits_) && Get(in, station.sojourns_)
+          && Get(in, station.departure_) && Get(in, station.red_)
+          && Get(in, station.dropStream_) && Get(in, station.offered_)
+          && Get(in, station.drops_) && Get(in, blocked)
+          && Get(in, station.blocking_) && Get(in, station.serving_)
+          && Get(in, station.classWaits_) && Get(in, station.finish_)
+          && Get(in, station.virtual_) && Get(in, station.shared_)
+          && Get(in, inbox);
+        station.blocked_.assign(blocked.begin(), blocked.end());
+        inbox_[j].assign(inbox.begin(), inbox.end());
+    }
+    return ok && sampler_.Load(in, network_);
+}
+
+// Sample the stations every interval of simulated time, with room for n
+// samples. A run resumed from a sampled one goes on at the interval
+// saved.
+void Simulation::Sample (double interval, size_t n) {
+    if (sampler_.Interval() == 0) {
+        sampler_.Start(interval, time_, n, network_);
+    }
+    nextSample_ = sampler_.Next();
+}
+
+// Execute the events up to time bound that are before endtime
+void Simulation::RunUntil (double bound, double endtime) {
+    const Event* p;
+    while ((p = scheduler_.Peek()) != NULL
+                && p->time_ <= bound && p->time_ < endtime) {
+        Step();
+    }
+}
+
+//---------------------------------------------------------------------------
+// Departure Event Handler
+//---------------------------------------------------------------------------
+
+// Destructor
+DepartureHandler::~DepartureHandler () {
+}
+
+// Return true if station j has a server free for a waiting packet
+bool DepartureHandler::Free (int j) const {
+    const Station& station = mSim.network_.StationAt(j);
+    return station.discipline_ == Station::PS
+        || station.serving_.size() < (size_t) station.servers_;
+}
+
+// Return the lane of the packet station j serves next, one waiting: the
+// packet of the first class by priority, or of the lowest WFQ tag
+int DepartureHandler::Pick (int j) const {
+    const Station& station = mSim.network_.StationAt(j);
+    const PacketQueue& queue = station.queue_;
+    int pick = -1;
+    for (size_t lane = 0; lane < queue.Lanes(); lane++) {
+        if (queue.Waiting(lane) == 0) {
+            continue;
+        }
+        if (pick < 0 || (station.discipline_ == Station::WFQ
+                         ? queue.Front(lane).tag_ < queue.Front(pick).tag_
+                         : station.ranks_[lane] < station.ranks_[pick])) {
+            pick = lane;
+        }
+    }
+    return pick;
+}
+
+// Return the rate each packet in service at processor sharing station j
+// is served at: one server each while there are enough of them
+double DepartureHandler::Rate (int j) const {
+    const Station& station = mSim.network_.StationAt(j);
+    size_t active = 0;
+    for (size_t k = 0; k < station.serving_.size(); k++) {
+        active += !station.serving_[k].blocked_;
+    }
+    return active > (size_t) station.servers_
+         ? (double) station.servers_ / active : 1.0;
+}
+
+// Bring the work left of the packets in service at processor sharing
+// station j up to date, before they change
+void DepartureHandler::Share (int j) {
+    Station& station = mSim.network_.StationAt(j);
+    double served = (mSim.time_ - station.shared_) * Rate(j);
+    for (size_t k = 0; k < station.serving_.size(); k++) {
+        if (!station.serving_[k].blocked_) {
+            station.serving_[k].end_ -= served;
+        }
+    }
+    station.shared_ = mSim.time_;
+}
+
+// Keep the time of the first departure of station j. Under processor
+// sharing the departures move as packets come and go: the first one is
+// scheduled again once it moved, and the event left at its old time is
+// ignored.
+void DepartureHandler::Reschedule (int j) {
+    Station& station = mSim.network_.StationAt(j);
+    bool shared = (station.discipline_ == Station::PS);
+    double rate = shared ? Rate(j) : 1.0;
+    double first = HUGE_VAL;
+    for (size_t k = 0; k < station.serving_.size(); k++) {
+        const Job& job = station.serving_[k];
+        if (!job.blocked_) {
+            first = std::min(first, shared ? station.shared_
+                             + std::max(job.end_, 0.0) / rate : job.end_);
+        }
+    }
+    if (shared && first != station.departure_ && first < HUGE_VAL) {
+        mSim.Schedule(DEPARTURE, j, first);
+    }
+    station.departure_ = first;
+}
+
+// Station takes packets from its queue while it has a server free, all
+// of them under processor sharing, and starts work: schedule their
+// departures.
+void DepartureHandler::Serve (int j) {
+    Station& station = mSim.network_.StationAt(j);
+    bool shared = (station.discipline_ == Station::PS);
+    if (shared) {
+        Share(j);
+    }
+    while (station.queue_.Waiting() > 0 && Free(j)) {
+        station.serving_.push_back(Job());
+        Job& job = station.serving_.back();
+        job.packet_ = station.queue_.Take(Pick(j));
+        if (station.discipline_ == Station::WFQ) {
+            job.work_ = job.packet_.work_;
+            station.virtual_ = job.packet_.tag_;
+        } else {
+            job.work_ = station.serviceTime_.Sample(station.variates_,
+                                                   job.packet_.size_);
+        }
+        job.begin_ = mSim.time_;
+        job.blocked_ = false;
+        if (shared) {
+            job.end_ = job.work_;
+        } else {
+            job.end_ = mSim.time_ + job.work_;
+            mSim.Schedule(DEPARTURE, j, job.end_);
+        }
+    }
+    station.service_.State(BUSY);
+    Reschedule(j);
+}
+
+// Return true if the packet p arriving at station j may enter its queue,
+// false if the queue drops it
+bool DepartureHandler::Admit (int j, const Packet& p) {
+    Station& station = mSim.network_.StationAt(j);
+    station.offered_[p.class_]++;
+    bool drop = false;
+    if (station.policy_ == Station::RED) {
+        const Distribution& time = station.serviceTime_;
+        drop = station.red_.Drop(station.queue_.QueueSize(), mSim.time_,
+                                 time.PerByte()
+                                     ? station.service_.ServiceTimes().Mean()
+                                     : time.Mean(),
+                                 station.dropStream_);
+    }
+    if (drop || station.queue_.Full()) {
+        station.drops_[p.class_]++;
+        if (TRACING && dFlag > 1) {
+            mSim.tee_ << "{" << station.name_ << " drops "
+                      << mSim.network_.ClassName(p.class_) << "} ";
+        }
+        return false;
+    }
+    return true;
+}
+
+// Packet p joins the queue of station j. At a WFQ station it draws its
+// service time and gets its finish tag, self-clocked (Golestani, 1994):
+// from the tag of the packet in service, or of the last packet of its
+// class if later, plus its service time over the weight of its class.
+// The tags start again from 0 with every busy period.
+void DepartureHandler::Join (int j, Packet& p) {
+    Station& station = mSim.network_.StationAt(j);
+    if (station.discipline_ == Station::WFQ) {
+        if (station.queue_.QueueSize() == 0) {
+            station.virtual_ = 0;
+            station.finish_.assign(station.finish_.size(), 0.0);
+        }
+        p.work_ = station.serviceTime_.Sample(station.variates_, p.size_);
+        p.tag_ = std::max(station.finish_[p.class_], station.virtual_)
+               + p.work_ / station.weights_[p.class_];
+        station.finish_[p.class_] = p.tag_;
+    }
+    station.queue_.Enqueue(p, mSim.time_);
+}
+
+// Packet enters the queue of station j, unless dropped
+void DepartureHandler::Enter (int j, const Packet& p) {
+    Station& station = mSim.network_.StationAt(j);
+    Packet packet = p;
+    if (station.analytic_) {
+        Pass(j, packet);
+        return;
+    }
+    if (!Admit(j, p)) {
+        return;
+    }
+    Join(j, packet);
+
+    // C-event (conditional event)
+    if (Free(j)) {
+        // Condition: packet in the queue and a server is free
+        // Change in system state: the station takes packet from its
+        // queue and starts work.
+
+        if (TRACING && dFlag > 1) {
+            mSim.tee_ << "{" << station.name_ << " starts work} ";
+        }
+        Serve(j);
+    }
+}
+
+// Event handler implementation for the derived class
+void DepartureHandler::handle (const Event& event) {
+    Tee& tee = mSim.tee_;
+    double now = mSim.time_;
+
+    if (TRACING && dFlag > 1) {
+        tee << "\nDEBUG: DepartureHandler: ";
+    }
+
+    Station& station = mSim.network_.StationAt(event.id_);
+    bool shared = (station.discipline_ == Station::PS);
+    if (shared) {
+        if (now != station.departure_) {
+            // Moved since, by packets coming or going
+            if (TRACING && dFlag > 1) {
+                tee << "{" << station.name_ << " departure moved} ";
+            }
+            return;
+        }
+        station.departure_ = HUGE_VAL;
+        Share(event.id_);
+    }
+
+    // The packet finished is the one in service ending first, with the
+    // least work left under processor sharing
+    size_t k = station.serving_.size();
+    for (size_t i = 0; i < station.serving_.size(); i++) {
+        const Job& job = station.serving_[i];
+        if (!job.blocked_
+                && (k == station.serving_.size()
+                    || job.end_ < station.serving_[k].end_)) {
+            k = i;
+        }
+    }
+    Packet finished = station.serving_[k].packet_;
+    double begin = shared ? now - station.serving_[k].work_
+                          : station.serving_[k].begin_;
+
+    // A packet for a full blocking queue stays in service, its server
+    // blocked until the queue has room
+    int next = station.routes_[finished.class_];
+    bool blocked = (next != Network::OUT
+                    && mSim.network_.StationAt(next).policy_ == Station::BLOCK
+                    && mSim.network_.StationAt(next).queue_.Full());
+    if (blocked) {
+        station.serving_[k].blocked_ = true;
+        station.serving_[k].end_ = now;
+    } else {
+        station.serving_.erase(station.serving_.begin() + k);
+        station.queue_.Leave(now);
+    }
+    if (blocked) {
+        if (TRACING && dFlag > 1) {
+            tee << "{STATE: " << station.name_ << " BLOCKED} ";
+        }
+        mSim.network_.StationAt(next).blocked_.push_back(event.id_);
+        Reschedule(event.id_);
+    } else {
+        NextService(event.id_);
+    }
+
+    Finish(event.id_, finished, begin, now);
+    if (!blocked) {
+        Forward(event.id_, finished, now);
+        Unblock(event.id_);
+    }
+
+    mSim.lastEventTime_ = now; // Update time of last event
+}
+
+// Station j finished the packet served from begin to end: compute and
+// display some stats on the station so far
+void DepartureHandler::Finish (int j, const Packet& finished, double begin,
+                               double end) {
+    Station& station = mSim.network_.StationAt(j);
+    Tee& tee = mSim.tee_;
+    bool entry = (finished.hops_ == 0); // first station of the packet
+
+    if (TRACING && dFlag > 1) {
+        tee << "SimulationTime=" << mSim.time_ << " "
+            << "LastEventTime=" << mSim.lastEventTime_ << " ";
+        if (entry) {
+            tee << "finished=" << finished.time_ << " (B"
+                << mSim.network_.EventNumber(ARRIVAL, finished.source_)
+                << ") ";
+        }
+    }
+
+    if (entry) {
+        mSim.stats_.ComputeTotalWaitingTime(end - finished.time_);
+        mSim.stats_.IncrementArrivals();
+    }
+
+    station.service_.stats(finished.time_, begin, end, tee);
+    station.served_[finished.class_]++;
+    if (station.queue_.Lanes() > 1) {
+        station.classWaits_[finished.class_].Add(begin - finished.time_);
+    }
+
+    if (mSim.trace_) {
+        const Service& service = station.service_;
+        TraceRecord record;
+        record.arrival_ = service.ArrivalTime();
+        record.begin_ = service.TimeServiceBegin();
+        record.end_ = service.TimeServiceEnd();
+        record.idle_ = service.IdleTimeOfService();
+        record.no_ = mSim.stats_.TotalArrivals();
+        record.station_ = j | (entry ? TraceRecord::ENTRY : 0);
+        record.class_ = finished.class_;
+        mSim.trace_->Write(record);
+    }
+}
+
+// Packet goes through the analytic station j without events: it waits a
+// time drawn from the model of the station (see Network::Hybrid), then
+// is served for a time drawn as usual, and goes on at once to the next
+// station if analytic too, or by a transfer event at the time it gets
+// there. A packet served past the end of the run is not counted.
+void DepartureHandler::Pass (int j, Packet& packet) {
+    Station& station = mSim.network_.StationAt(j);
+    if (TRACING && dFlag > 1) {
+        mSim.tee_ << "{" << station.name_ << " passes} ";
+    }
+    double wait = 0;
+    if (!nFlag && station.dropStream_.Uniform() < station.load_) {
+        wait = station.dropStream_.Exponential(station.wait_
+                                               / station.load_);
+    }
+    double begin = packet.time_ + wait;
+    double end = begin + station.serviceTime_.Sample(station.variates_);
+    if (end > mSim.endTime_) {
+        return;
+    }
+    Finish(j, packet, begin, end);
+    station.queue_.Spend(end - packet.time_);
+    Forward(j, packet, end);
+}
+
+// Station j, a packet out of service, serves the next one if any
+void DepartureHandler::NextService (int j) {
+    Station& station = mSim.network_.StationAt(j);
+
+    // Check to see whether the station queue is empty
+    if (station.queue_.Waiting() > 0) {
+        if (TRACING && dFlag > 1) {
+            mSim.tee_ << "{STATE: " << station.name_ << " BUSY} ";
+        }
+
+        // Schedule the next departure.
+        Serve(j);
+
+    } else {
+        if (station.serving_.empty()) {
+            station.service_.State(IDLE); // Begin idle time
+            station.red_.Idle(mSim.time_);
+            if (TRACING && dFlag > 1) {
+                mSim.tee_ << "{STATE: " << station.name_ << " IDLE} ";
+            }
+        }
+        Reschedule(j);
+    }
+}
+
+// Pass the packet finished by station j at time now to its next station,
+// or out of the network
+void DepartureHandler::Forward (int j, Packet& finished, double now) {
+    Station& station = mSim.network_.StationAt(j);
+
+    int next = station.routes_[finished.class_];
+    if (next != Network::OUT) {
+        // Station completes work and outputs the packet to the next queue
+        finished.time_ = now;
+        finished.hops_++;
+        const Station& to = mSim.network_.StationAt(next);
+        if (to.lp_ == mSim.lp_ && (now == mSim.time_ || to.analytic_)) {
+            Enter(next, finished);
+        } else {
+            // The station belongs to another logical process, or the
+            // packet gets there later, from an analytic station
+            Transfer transfer;
+            transfer.time_ = now;
+            transfer.station_ = next;
+            transfer.class_ = finished.class_;
+            transfer.hops_ = finished.hops_;
+            transfer.entry_ = finished.entry_;
+            transfer.size_ = finished.size_;
+            if (to.lp_ == mSim.lp_) {
+                mSim.Receive(transfer);
+            } else {
+                mSim.outbox_.push_back(transfer);
+            }
+        }
+    } else {
+        // Packet leaves the network
+        station.exits_[finished.class_]++;
+        station.sojourns_[finished.class_].Add(now - finished.entry_);
+        mSim.Observe(now - finished.entry_);
+    }
+}
+
+// Let the stations and sources blocked by station j pass their packets
+// while its queue has room, in the order they were blocked
+void DepartureHandler::Unblock (int j) {
+    Station& station = mSim.network_.StationAt(j);
+    while (!station.blocked_.empty() && !station.queue_.Full()) {
+        int holder = station.blocked_.front();
+        station.blocked_.pop_front();
+        if (holder >= 0) {
+            Release(holder, j);
+        } else {
+            Source& source = mSim.network_.SourceAt(-1 - holder);
+            station.blocking_.Add(mSim.time_ - source.blockedSince_);
+            if (TRACING && dFlag > 1) {
+                mSim.tee_ << "{B" << mSim.network_.EventNumber(ARRIVAL,
+                                                              -1 - holder)
+                          << " unblocked} ";
+            }
+            Packet packet = source.held_;
+            packet.time_ = mSim.time_;
+            Enter(j, packet);
+            mSim.arrivalHandler_.ScheduleArrival(-1 - holder);
+        }
+    }
+}
+
+// Station j, blocked by station to, passes on the packet blocked first
+// for it and goes on working
+void DepartureHandler::Release (int j, int to) {
+    Station& station = mSim.network_.StationAt(j);
+    if (TRACING && dFlag > 1) {
+        mSim.tee_ << "{" << station.name_ << " unblocked} ";
+    }
+    size_t k = station.serving_.size();
+    for (size_t i = 0; i < station.serving_.size(); i++) {
+        const Job& job = station.serving_[i];
+        if (job.blocked_ && station.routes_[job.packet_.class_] == to
+                && (k == station.serving_.size()
+                    || job.end_ < station.serving_[k].end_)) {
+            k = i;
+        }
+    }
+    Packet finished = station.serving_[k].packet_;
+    mSim.network_.StationAt(to).blocking_.Add(mSim.time_
+                                              - station.serving_[k].end_);
+    station.serving_.erase(station.serving_.begin() + k);
+    station.queue_.Leave(mSim.time_);
+    station.service_.Release(mSim.time_);
+    NextService(j);
+    Forward(j, finished, mSim.time_);
+    Unblock(j);
+}
+
+//---------------------------------------------------------------------------
+// Arrival Event Handler
+//---------------------------------------------------------------------------
+
+// Destructor
+ArrivalHandler::~ArrivalHandler() {
+}
+
+// Schedule the next arrival from source i. A trace source reads it from
+// its log, no sooner than now if it was blocked, and stops at the end of
+// the log, checked when opened.
+void ArrivalHandler::ScheduleArrival (int i) {
+    Source& source = mSim.network_.SourceAt(i);
+    if (!source.log_.IsOpen()) {
+        double interval = source.interArrival_.Sample(source.variates_);
+        mSim.Schedule(ARRIVAL, i, mSim.time_ + interval);
+        return;
+    }
+    double time;
+    string error;
+    if (source.log_.Next(time, source.size_, error)) {
+        mSim.Schedule(ARRIVAL, i, std::max(time, mSim.time_));
+    }
+}
+
+// Event handler implementation for ArrivalHandler
+void ArrivalHandler::handle(const Event& event)
+{
+    if (TRACING && dFlag > 1) {
+        mSim.tee_ << "\nDEBUG: ArrivalHandler: ";
+    }
+
+    // Packet arrives and enters the queue of its first station
+    Source& source = mSim.network_.SourceAt(event.id_);
+    Station& station = mSim.network_.StationAt(source.station_);
+    mSim.stats_.RecordArrival(source.class_, mSim.time_);
+    Packet packet;
+    packet.time_ = mSim.time_;
+    packet.entry_ = mSim.time_;
+    packet.class_ = source.class_;
+    packet.source_ = event.id_;
+    packet.size_ = source.size_;
+
+    if (station.policy_ == Station::BLOCK && station.queue_.Full()) {
+        // The source holds the packet and stops until the queue has room
+        if (TRACING && dFlag > 1) {
+            mSim.tee_ << "{STATE: B"
+                      << mSim.network_.EventNumber(ARRIVAL, event.id_)
+                      << " BLOCKED} ";
+        }
+        source.held_ = packet;
+        source.blockedSince_ = mSim.time_;
+        station.blocked_.push_back(-1 - event.id_);
+        mSim.lastEventTime_ = mSim.time_; // Update time of last event
+        return;
+    }
+    if (station.analytic_) {
+        mSim.departureHandler_.Pass(source.station_, packet);
+    } else if (mSim.departureHandler_.Admit(source.station_, packet)) {
+        mSim.departureHandler_.Join(source.station_, packet);
+
+        // C-event (conditional event) (C1)
+        // Check to see whether the station is busy
+        if (mSim.departureHandler_.Free(source.station_)) {
+            // Condition: packet in the queue and a server is free
+            // Change in system state: the station takes packet from its
+            // queue and starts work.
+
+            if (TRACING && dFlag > 1) {
+                mSim.tee_ << "{" << station.name_ << " starts work} ";
+            }
+            mSim.departureHandler_.Serve(source.station_);
+
+        } else {
+            if (TRACING && dFlag > 1) {
+                mSim.tee_ << "{STATE: " << station.name_ << " BUSY'} ";
+            }
         }
+    }
+
+    // Schedule the next arrival from this source.
+    ScheduleArrival(event.id_);
+
+    mSim.lastEventTime_ = mSim.time_; // Update time of last event
+}
+
+// Event handler implementation for TransferHandler: the packet is the
+// first one received by the station
+void TransferHandler::handle (const Event& event) {
+    if (TRACING && dFlag > 1) {
+        mSim.tee_ << "\nDEBUG: TransferHandler: ";
+    }
+    std::deque<Transfer>& inbox = mSim.inbox_[event.id_];
+    const Transfer& t = inbox.front();
+    Packet packet;
+    packet.time_ = t.time_;
+    packet.entry_ = t.entry_;
+    packet.class_ = t.class_;
+    packet.hops_ = t.hops_;
+    packet.size_ = t.size_;
+    inbox.pop_front();
+    mSim.departureHandler_.Enter(event.id_, packet);
+    mSim.lastEventTime_ = mSim.time_; // Update time of last event
+}
+
+//---------------------------------------------------------------------------
+// Report performance metrics for the simulation
+//---------------------------------------------------------------------------
+
+// Add the mean and quantiles of the times of a summary to the metrics
+void SummaryMetrics (const string& name, const Summary& summary,
+                     int station, vector<Metric>& metrics) {
+    metrics.push_back(Metric("Mean " + name, summary.Mean(), " sec",
+                             station));
+    for (size_t q = 0; q < NUM_QUANTILES; q++) {
+        metrics.push_back(Metric(string(QUANTILE_NAMES[q]) + " " + name,
+                                 summary.Quantile(q), " sec", station));
+    }
+}
+
+// Collect the metrics of the report, in report order, of a run that
+// ended at time with the network and stats given
+void CollectMetrics (double time, const Network& network,
+                     const Stats& stats, vector<Metric>& metrics) {
+    metrics.clear();
+    metrics.push_back(Metric("Total simulated time", time, " sec", -1));
+    if (wFlag) {
+        metrics.push_back(Metric("Warm-up deleted", stats.WarmUp(), " sec",
+                                 -1));
+    }
 
-        gpRouter->stats(finished->time_);
+    for (size_t c = 0; c < network.Classes(); c++) {
+        const Moments& gaps = stats.InterArrivals(c);
+        metrics.push_back(Metric("Mean interarrival time for "
+                                 + network.ClassName(c),
+                                 gaps.Mean(), " sec", -1));
+        metrics.push_back(Metric("Std dev of interarrival time for "
+                                 + network.ClassName(c),
+                                 gaps.StdDev(), " sec", -1));
+    }
 
-        if (finished->type_ == B1) {
-            gpStats->ComputeMeanPxInterArrivalTime(finished->time_);
+    for (size_t j = 0; j < network.Stations(); j++) {
+        const Station& station = network.StationAt(j);
+        const Service& service = station.service_;
+
+        // Packets leaving the network from this station
+        for (size_t c = 0; c < network.Classes(); c++) {
+            if (station.visits_[c] && station.routes_[c] == Network::OUT) {
+                metrics.push_back(Metric("Total " + network.ClassName(c)
+                                         + " served by " + station.name_,
+                                         station.exits_[c], "", j));
+                SummaryMetrics("time in network for " + network.ClassName(c)
+                               + " at " + station.name_,
+                               station.sojourns_[c], j, metrics);
+            }
+        }
 
-        } else if (finished->type_ == B2) {
-            gpStats->ComputeMeanPyInterArrivalTime(finished->time_);
+        // Compute the station mean service time
+        double meanServiceTime = 0.0;
+        if (service.TotalPacket() > 0) {
+            meanServiceTime = service.TotalServiceTime()/service.TotalPacket();
+        }
+        metrics.push_back(Metric("Mean service time for " + station.name_,
+                                 meanServiceTime, " sec", j));
+        metrics.push_back(Metric("Std dev of service time for "
+                                 + station.name_,
+                                 service.ServiceTimes().StdDev(), " sec", j));
+        SummaryMetrics("wait in queue for " + station.name_,
+                       service.Waits(), j, metrics);
+        SummaryMetrics("time spent at " + station.name_,
+                       service.Spends(), j, metrics);
+        metrics.push_back(Metric("Mean queue length for " + station.name_,
+                                 station.queue_.MeanQueueSize(time),
+                                 " packets", j));
+
+        // Queueing model of the station in a hybrid run, and its error
+        if (hFlag) {
+            metrics.push_back(Metric("Analytic " + station.name_,
+                                     station.analytic_, "", j));
+            metrics.push_back(Metric("Utilization offered to "
+                                     + station.name_,
+                                     100 * station.load_, " %", j));
+            metrics.push_back(Metric("Model wait in queue for "
+                                     + station.name_,
+                                     station.wait_, " sec", j));
+            metrics.push_back(Metric("Model error of wait in queue for "
+                                     + station.name_,
+                                     station.error_, " sec", j));
         }
 
-        gOutfile2 << " ";
+        // Waits of each class at a station choosing among the classes
+        if (station.queue_.Lanes() > 1) {
+            for (size_t c = 0; c < network.Classes(); c++) {
+                if (station.visits_[c]) {
+                    SummaryMetrics("wait in queue for "
+                                   + network.ClassName(c) + " at "
+                                   + station.name_,
+                                   station.classWaits_[c], j, metrics);
+                }
+            }
+        }
 
-        if (finished->type_ == B1) {
-            // Router completes work and outputs Px to S1 queue
-            finished->time_ = gSimulationTime;
-            gpS1Queue->Enqueue(finished);
+        // Losses and blocking of a finite queue
+        if (station.queue_.Capacity() == 0) {
+            continue;
+        }
+        for (size_t c = 0; c < network.Classes(); c++) {
+            if (!station.visits_[c] || station.policy_ == Station::BLOCK) {
+                continue;
+            }
+            size_t offered = station.offered_[c];
+            metrics.push_back(Metric("Total " + network.ClassName(c)
+                                     + " dropped by " + station.name_,
+                                     station.drops_[c], "", j));
+            metrics.push_back(Metric("Loss of " + network.ClassName(c)
+                                     + " at " + station.name_,
+                                     offered > 0 ? 100.0 * station.drops_[c]
+                                                   / offered : 0.0,
+                                     " %", j));
+        }
+        if (station.policy_ == Station::BLOCK) {
+            metrics.push_back(Metric("Total packets held for "
+                                     + station.name_,
+                                     station.blocking_.Count(), "", j));
+            metrics.push_back(Metric("Mean time held for " + station.name_,
+                                     station.blocking_.Mean(), " sec", j));
+        }
+    }
+}
 
-            // C-event (conditional event): (C2)
-            if (gpS1->State() == IDLE) {
-                // Condition: packet in S1 queue and S1 is idle
-                // Change in system state: S1 takes packet from its queue
-                // and starts work.
+// Write the report of the metrics of a run on the network given
+void ReportMetrics (Tee& tee, const Network& network,
+                    const vector<Metric>& metrics) {
+    if (dFlag) {
+        tee << "\n"
+            << "========================================================="
+            << "\n\n";
+    }
 
-                if (dFlag > 1) {
-                    gTee << "{S1 starts work} ";
+    tee << "Performance metrics for the simulation:\n"
+        << "========================================================="
+        << "\n\n";
+
+    int station = -1;
+    for (size_t m = 0; m < metrics.size(); m++) {
+        const Metric& metric = metrics[m];
+
+        if (dFlag > 1 && metric.station_ >= 0 && metric.station_ != station) {
+            // Packets served by the station, per class
+            const Station& s = network.StationAt(metric.station_);
+            const char* separator = "";
+            tee << s.name_ << ":\n";
+            for (size_t c = 0; c < network.Classes(); c++) {
+                if (s.visits_[c]) {
+                    tee << separator << "Total " << network.ClassName(c)
+                        << " served by " << s.name_ << " = "
+                        << s.served_[c];
+                    separator = ", ";
                 }
+            }
+            tee << "\n";
+        }
+        station = metric.station_;
+
+        tee << metric.name_ << " = ";
+        if (*metric.unit_) {
+            tee << metric.value_;
+        } else {
+            tee << static_cast<size_t>(metric.value_); // a count
+        }
+        tee << metric.unit_ << "\n";
+    }
+    tee << "\n";
+}
+
+// Collect the metrics of the run
+void Simulation::Metrics (vector<Metric>& metrics) const {
+    CollectMetrics(time_, network_, stats_, metrics);
+}
+
+// Report performance metrics of the run
+void Simulation::Report () {
+    vector<Metric> metrics;
+    Metrics(metrics);
+    ReportMetrics(tee_, network_, metrics);
+
+    if (precision_ > 0) {
+        double mean = batchMeans_.Mean();
+        double halfWidth = batchMeans_.HalfWidth();
+        tee_ << "Steady-state time in network = " << mean << " +/- "
+             << halfWidth << " sec\n"
+             << "(" << batchMeans_.Batches() << " batch means of "
+             << batchMeans_.BatchSize() << " packets, relative half width "
+             << (mean != 0 ? halfWidth / fabs(mean) : 0.0)
+             << (precise_ ? "" : ", precision not reached") << ")\n\n";
+    }
+}
 
-                // Schedule the next departure (B4 event).
-                double serviceTime;
-                !nFlag
-                    ? serviceTime = gpRandomStream->NextNormal(
-                                                     gS1ServiceTime, gSigma1)
-                    : serviceTime = gS1ServiceTime;
+//---------------------------------------------------------------------------
+// Independent replications
+//---------------------------------------------------------------------------
 
-                gScheduler.Schedule(&gDepartureHandler,
-                               new Event(B4, gSimulationTime + serviceTime));
-                gpS1->State(BUSY);
-            }
-        } else if (finished->type_ == B2) {
-            // Router completes work and outputs Py to S2 queue
-            finished->time_ = gSimulationTime;
-            gpS2Queue->Enqueue(finished);
-
-            // C-event (conditional event): (C3)
-            if ( gpS2->State() == IDLE) {
-                // Condition: packet in S2 queue and S2 is idle
-                // Change in system state: S2 takes packet from its queue
-                // and starts work.
-
-                if (dFlag > 1) {
-                    gTee << "{S2 starts work} ";
-                }
+// Runs N replications of each of a list of networks (one, or the
+// configurations of a sweep) on a pool of threads. Replication k uses
+// substream k of the seed, so the results do not depend on the number
+// of threads, and the configurations share their random numbers: each
+// source draws the same interarrival times and each station the same
+// service times in every configuration. Antithetic replications run in
+// pairs on substream k / 2, the second of each pair antithetic.
+class Replications {
+public:
+    Replications (const vector<Network>&, const string&, uint64_t, size_t,
+                  bool = false);
+    ~Replications () {}
+    void Run (size_t, double, size_t);
+    void Report () const;
+    void Table (std::ostream&, const vector<string>&,
+                const vector<vector<double> >&, bool = false) const;
 
-                // Schedule the next departure (B5 event).
-                double serviceTime;
-                !nFlag
-                    ? serviceTime = gpRandomStream->NextNormal(
-                                                     gS2ServiceTime, gSigma2)
-                    : serviceTime = gS2ServiceTime;
+private:
+    const vector<Network>& mNetworks;
+    string mFEL;
+    uint64_t mSeed;
+    size_t mReplications; // replications per network
+    bool mAntithetic; // replications in antithetic pairs
+    // Metrics of each replication, network after network
+    vector<vector<Metric> > mResults;
+    std::atomic<size_t> mNext; // next replication to run
+    double mEndTime;
+    size_t mEndPx;
+
+    void Worker ();
+    double Observation (size_t, size_t, size_t) const;
+    void Summarize (size_t, bool, vector<double>&, vector<double>&) const;
+
+    Replications (const Replications&);
+    Replications& operator= (const Replications&);
+};
 
-                gScheduler.Schedule(&gDepartureHandler,
-                               new Event(B5, gSimulationTime + serviceTime));
+// Constructor
+Replications::Replications (const vector<Network>& networks,
+                            const string& fel, uint64_t seed, size_t n,
+                            bool antithetic)
+    : mNetworks(networks), mFEL(fel), mSeed(seed), mReplications(n),
+      mAntithetic(antithetic), mResults(networks.size() * n), mNext(0),
+      mEndTime(0), mEndPx(0) {
+}
 
-                gpS2->State(BUSY);
-            }
+// Take replications until none is left
+void Replications::Worker () {
+    size_t r;
+    while ((r = mNext++) < mResults.size()) {
+        size_t k = r % mReplications;
+        Simulation sim(mNetworks[r / mReplications], mFEL, mSeed,
+                       mAntithetic ? k / 2 : k, false);
+        if (mAntithetic && k % 2) {
+            sim.Antithetic();
         }
+        sim.Run(mEndTime, mEndPx);
+        sim.Metrics(mResults[r]);
+    }
+}
 
-    } else if (event->type_ == B4) {
-        Packet* finished = gpS1Queue->Dequeue();
-
-        // Check to see whether S1 queue is empty
-        if ( gpS1Queue->QueueSize () > 0) {
-            if (dFlag > 1) {
-                gTee <<"{STATE: S1 BUSY} ";
-            }
+// Run all the replications on the given number of threads
+void Replications::Run (size_t threads, double endtime, size_t endpx) {
+    mEndTime = endtime;
+    mEndPx = endpx;
+    mNext = 0;
 
-            // Schedule the next departure (B4 event).
-            double serviceTime;
-            !nFlag
-                ? serviceTime = gpRandomStream->NextNormal(
-                                                     gS1ServiceTime, gSigma1)
-                : serviceTime = gS1ServiceTime;
+    vector<std::thread> pool;
+    for (size_t i = 0; i < std::min(threads, mResults.size()); i++) {
+        pool.push_back(std::thread(&Replications::Worker, this));
+    }
+    for (size_t i = 0; i < pool.size(); i++) {
+        pool[i].join();
+    }
+}
 
-            gScheduler.Schedule(&gDepartureHandler,
-                               new Event(B4, gSimulationTime + serviceTime));
+// Return metric m of observation k of network i: replication k, or the
+// mean of antithetic pair k
+double Replications::Observation (size_t i, size_t k, size_t m) const {
+    const vector<Metric>* results = &mResults[i * mReplications];
+    if (mAntithetic) {
+        return (results[2*k][m].value_ + results[2*k + 1][m].value_) / 2;
+    }
+    return results[k][m].value_;
+}
 
-        } else {
-            gpS1->State(IDLE); // Begin idle time
-            if (dFlag > 1) {
-                gTee << "{STATE: S1 IDLE} ";
+// Compute the mean of every metric over the observations of network i,
+// with the half width of its 95% confidence interval (0 with a single
+// observation). Paired, the observations are the differences from those
+// of the first network on the same random numbers.
+void Replications::Summarize (size_t i, bool paired, vector<double>& means,
+                              vector<double>& halfWidths) const {
+    size_t n = mAntithetic ? mReplications / 2 : mReplications;
+    double t = (n > 1) ? StudentT975(n - 1) : 0.0;
+    vector<double> x(n);
+
+    means.assign(mResults[i * mReplications].size(), 0.0);
+    halfWidths.assign(means.size(), 0.0);
+    for (size_t m = 0; m < means.size(); m++) {
+        double sum = 0.0;
+        for (size_t k = 0; k < n; k++) {
+            x[k] = Observation(i, k, m);
+            if (paired) {
+                x[k] -= Observation(0, k, m);
             }
+            sum += x[k];
         }
+        double mean = sum/n;
 
-        // Compute and display some stats on S1 so far
-        if (dFlag > 1) {
-            gTee << "SimulationTime=" << gSimulationTime << " "
-                 << "LastEventTime=" << gLastEventTime << " ";
+        double squares = 0.0;
+        for (size_t k = 0; k < n; k++) {
+            double d = x[k] - mean;
+            squares += d*d;
         }
+        means[m] = mean;
+        if (n > 1) {
+            halfWidths[m] = t*sqrt(squares/(n - 1)/n);
+        }
+    }
+}
 
-        gOutfile2 << "S1" << ","
-                  << gpStats->TotalArrivals() << ","
-                  << "Px" << ",";
-
-        gpS1->stats(finished->time_);
-        gOutfile2 << " ";
+// Report the mean of every metric over the replications of the first
+// network, with the half width of its 95% confidence interval
+void Replications::Report () const {
+    vector<double> means, halfWidths;
+    Summarize(0, false, means, halfWidths);
 
-        delete finished;
+    cout << "\nPerformance metrics over " << mReplications
+         << " replications";
+    if (mAntithetic) {
+        cout << " in " << mReplications / 2 << " antithetic pairs";
+    }
+    cout << ":\n"
+         << "(mean +/- half width of the 95% confidence interval)\n"
+         << "========================================================="
+         << "\n\n";
 
-    } else if (event->type_ == B5) {
-        Packet* finished = gpS2Queue->Dequeue();
+    const vector<Metric>& first = mResults[0];
+    for (size_t m = 0; m < first.size(); m++) {
+        cout << first[m].name_ << " = " << means[m] << " +/- "
+             << halfWidths[m] << first[m].unit_ << "\n";
+    }
+    cout << "\n";
+}
 
-        // Check to see whether S2 queue is empty
-        if ( gpS2Queue->QueueSize () > 0) {
-            if (dFlag > 1) {
-                gTee <<"{STATE: S2 BUSY} ";
+// Write the results as a tab separated table, one row per network with
+// the values of the variables given, then the mean of every metric, and
+// its half width after it if replicated. Paired, the metrics are the
+// differences from the first network.
+void Replications::Table (std::ostream& out, const vector<string>& names,
+                          const vector<vector<double> >& values,
+                          bool paired) const {
+    vector<string> columns(names);
+    const vector<Metric>& first = mResults[0];
+    for (size_t m = 0; m < first.size(); m++) {
+        string name = first[m].name_ + (paired ? " - first" : "");
+        if (*first[m].unit_) {
+            name += " (" + string(first[m].unit_ + 1) + ")";
+        }
+        columns.push_back(name);
+        if (mReplications > 1) {
+            columns.push_back(name + " +/-");
+        }
+    }
+    for (size_t c = 0; c < columns.size(); c++) {
+        out << (c ? "\t" : "") << columns[c];
+    }
+    out << "\n";
+
+    vector<double> means, halfWidths;
+    for (size_t i = 0; i < mNetworks.size(); i++) {
+        Summarize(i, paired, means, halfWidths);
+        const char* separator = "";
+        for (size_t v = 0; v < names.size(); v++) {
+            out << separator << values[i][v];
+            separator = "\t";
+        }
+        for (size_t m = 0; m < means.size(); m++) {
+            out << separator << means[m];
+            if (mReplications > 1) {
+                out << "\t" << halfWidths[m];
             }
+            separator = "\t";
+        }
+        out << "\n";
+    }
+}
 
-            // Schedule the next departure (B5 event).
-            double serviceTime;
-            !nFlag
-                ? serviceTime = gpRandomStream->NextNormal(
-                                                     gS2ServiceTime, gSigma2)
-                : serviceTime = gS2ServiceTime;
+//---------------------------------------------------------------------------
+// Parameter sweep
+//---------------------------------------------------------------------------
 
-            gScheduler.Schedule(&gDepartureHandler,
-                               new Event(B5, gSimulationTime + serviceTime));
+// Variable of a sweep, written $name in the topology, with its values
+class Variable {
+public:
+    string name_;
+    vector<double> values_;
+    bool Parse (const string&);
+};
 
-        } else {
-            gpS2->State(IDLE); // Begin idle time
-            if (dFlag > 1) {
-                gTee << "{STATE: S2 IDLE} ";
-            }
+// Read "name=first:last:step" or "name=value,value,..."
+bool Variable::Parse (const string& text) {
+    size_t equal = text.find('=');
+    if (equal == string::npos || equal == 0) {
+        return false;
+    }
+    name_ = text.substr(0, equal);
+    for (size_t i = 0; i < name_.size(); i++) {
+        if (!isalnum(name_[i]) && name_[i] != '_') {
+            return false;
         }
+    }
 
-        // Compute and display some stats on S2 so far
-        if (dFlag > 1) {
-            gTee << "SimulationTime=" << gSimulationTime << " "
-                 << "LastEventTime=" << gLastEventTime << " ";
+    string list = text.substr(equal + 1);
+    values_.clear();
+    if (list.find(':') != string::npos) {
+        // Range, last included up to rounding errors
+        double first, last, step;
+        char colon1, colon2;
+        istringstream iss(list);
+        if (!(iss >> first >> colon1 >> last >> colon2 >> step)
+                || colon1 != ':' || colon2 != ':' || !iss.eof()
+                || step == 0 || (last - first) / step < 0) {
+            return false;
         }
+        size_t count = (size_t) ((last - first) / step + 1e-9) + 1;
+        for (size_t i = 0; i < count; i++) {
+            values_.push_back(first + i * step);
+        }
+        return true;
+    }
+    istringstream iss(list);
+    double value;
+    char comma = ',';
+    while (comma == ',' && iss >> value) {
+        values_.push_back(value);
+        if (!(iss >> comma)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-        gOutfile2 << "S2" << ","
-                  << gpStats->TotalArrivals() << ","
-                  << "Py" << ",";
-
-        gpS2->stats(finished->time_);
-        gOutfile2 << " ";
+// Write the topology text into out with every $name of the variables
+// replaced by the value of the same index in values. Fails on an unknown
+// variable, or one not in the topology.
+bool Substitute (const string& text, const vector<Variable>& variables,
+                 const vector<double>& values, string& out, string& error) {
+    vector<bool> used(variables.size(), false);
+    std::ostringstream oss;
+    oss.precision(17);
+    bool comment = false;
+    for (size_t n = 0; n < text.size(); n++) {
+        char c = text[n];
+        if (c == '\n' || c == '#') {
+            comment = (c == '#');
+        }
+        if (c != '$' || comment) {
+            oss << c;
+            continue;
+        }
+        size_t end = n + 1;
+        while (end < text.size() && (isalnum(text[end]) || text[end] == '_')) {
+            end++;
+        }
+        string name = text.substr(n + 1, end - n - 1);
+        size_t v = 0;
+        while (v < variables.size() && variables[v].name_ != name) {
+            v++;
+        }
+        if (v == variables.size()) {
+            error = "unknown variable $" + name;
+            return false;
+        }
+        oss << values[v];
+        used[v] = true;
+        n = end - 1;
+    }
+    for (size_t v = 0; v < variables.size(); v++) {
+        if (!used[v]) {
+            error = "variable " + variables[v].name_ + " not used";
+            return false;
+        }
+    }
+    out = oss.str();
+    return true;
+}
 
-        delete finished;
+// Load one network per configuration of the sweep, the Cartesian
+// product of the values of the variables, the last one varying the
+// fastest. The values of each configuration go to values.
+bool LoadSweep (const string& text, const vector<Variable>& variables,
+                vector<Network>& networks, vector<vector<double> >& values,
+                string& error) {
+    size_t count = 1;
+    for (size_t v = 0; v < variables.size(); v++) {
+        count *= variables[v].values_.size();
+    }
+    networks.assign(count, Network());
+    values.assign(count, vector<double>(variables.size()));
+    for (size_t i = 0; i < count; i++) {
+        size_t rest = i;
+        for (size_t v = variables.size(); v-- > 0; ) {
+            const vector<double>& range = variables[v].values_;
+            values[i][v] = range[rest % range.size()];
+            rest /= range.size();
+        }
+        string topology;
+        if (!Substitute(text, variables, values[i], topology, error)) {
+            return false;
+        }
+        istringstream iss(topology);
+        if (!networks[i].Load(iss, error)) {
+            std::ostringstream where;
+            for (size_t v = 0; v < variables.size(); v++) {
+                where << (v ? ", " : "") << variables[v].name_ << "="
+                      << values[i][v];
+            }
+            error = where.str() + ": " + error;
+            return false;
+        }
     }
-    gLastEventTime = gSimulationTime; // Update time of last event
-    delete event;
+    return true;
 }
 
 //---------------------------------------------------------------------------
-// Arrival Event Handler
+// Conservative parallel simulation
 //---------------------------------------------------------------------------
 
-class ArrivalHandler : public Handler {
+// Reusable barrier for a fixed number of threads
+class Barrier {
 public:
-    ~ArrivalHandler ();
-    void handle (Event*);
-} gArrivalHandler;
+    Barrier (size_t n) : mCount(n), mWaiting(0), mGeneration(0) {}
+    size_t Count () const { return mCount; }
+    void Wait ();
 
-// Destructor
-ArrivalHandler::~ArrivalHandler() {
-}
+private:
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    size_t mCount; // threads to wait for
+    size_t mWaiting; // threads waiting
+    size_t mGeneration; // times the barrier opened
+};
 
-// Event handler implementation for ArrivalHandler
-void ArrivalHandler::handle(Event* event)
-{
-    if (dFlag > 1) {
-        gTee << "\nDEBUG: ArrivalHandler: ";
+// Wait until all the threads have reached the barrier
+void Barrier::Wait () {
+    std::unique_lock<std::mutex> lock(mMutex);
+    size_t generation = mGeneration;
+    if (++mWaiting == mCount) {
+        mWaiting = 0;
+        mGeneration++;
+        mCondition.notify_all();
+    } else {
+        while (generation == mGeneration) {
+            mCondition.wait(lock);
+        }
     }
+}
 
-    // Packet, Px/Py arrives and enters the router queue
-    gpRouterQueue->Enqueue((Packet*) event);
+// One run split over logical processes (LPs), each a Simulation of the
+// stations partitioned to it, run by a thread of its own (YAWNS). The run
+// advances in windows: every LP executes its events up to the lower
+// bound on the time stamp of any packet an LP may still pass to another
+// one (LBTS), then the LPs wait at a barrier while the packets passed are
+// delivered. A station passing packets on bounds them by its scheduled
+// departure while busy, and by the imminent event time plus its minimum
+// service time (its lookahead) while idle.
+// Sources and stations draw from the same substreams as in a sequential
+// run, so the results are the same unless two events of different LPs
+// happen at the very same time.
+class ParallelSimulation {
+public:
+    ParallelSimulation (const Network&, const string&, uint64_t, size_t);
+    ~ParallelSimulation ();
+    size_t LPs () const { return mLPs.size(); }
+    void Run (double);
+    void Report ();
 
-    // C-event (conditional event) (C1)
-    // Check to see whether router is busy
-    if (gpRouter->State() == IDLE) {
-        // Condition: packet in router queue and router is idle
-        // Change in system state: router takes packet from its queue
-        // and starts work.
+private:
+    Network mNetwork; // the network partitioned
+    Barrier mBarrier;
+    vector<Simulation*> mLPs;
+    vector<int> mCross; // stations passing packets to other LPs
+    double mBound; // end of the current window
+    double mEndTime;
+    bool mDone;
+    double mTime; // time of the last event
+    size_t mWindows; // windows run
+
+    void Deliver ();
+    double Next (size_t&) const;
+    double Bound (double) const;
+    void Worker (size_t);
+
+    ParallelSimulation (const ParallelSimulation&);
+    ParallelSimulation& operator= (const ParallelSimulation&);
+};
 
-        if (dFlag > 1) {
-            gTee << "{R starts work} ";
+// Constructor, splits the network into at most lps LPs
+ParallelSimulation::ParallelSimulation (const Network& network,
+                                        const string& fel, uint64_t seed,
+                                        size_t lps)
+    : mNetwork(network), mBarrier(mNetwork.Partition(lps)), mBound(0),
+      mEndTime(0), mDone(false), mTime(0), mWindows(0) {
+    for (size_t i = 0; i < mBarrier.Count(); i++) {
+        mLPs.push_back(new Simulation(mNetwork, fel, seed, 0, false, i));
+    }
+    for (size_t j = 0; j < mNetwork.Stations(); j++) {
+        if (mNetwork.StationAt(j).cross_) {
+            mCross.push_back(j);
         }
+    }
+}
 
-        // Schedule the next departure (B3 event).
-        double serviceTime;
-        !nFlag
-            ? serviceTime = gpRandomStream->NextNormal(
-                                                 gRouterServiceTime, gSigma)
-            : serviceTime = gRouterServiceTime;
-
-        gScheduler.Schedule(&gDepartureHandler,
-                               new Event(B3, gSimulationTime + serviceTime));
-        gpRouter->State(BUSY); // Update router state
+// Destructor
+ParallelSimulation::~ParallelSimulation () {
+    for (size_t i = 0; i < mLPs.size(); i++) {
+        delete mLPs[i];
+    }
+}
 
-    } else {
-        if (dFlag > 1) {
-            gTee << "{STATE: R BUSY'} ";
+// Pass the packets sent during the last window to their LPs
+void ParallelSimulation::Deliver () {
+    for (size_t i = 0; i < mLPs.size(); i++) {
+        vector<Transfer>& outbox = mLPs[i]->outbox_;
+        for (size_t k = 0; k < outbox.size(); k++) {
+            const Transfer& t = outbox[k];
+            mLPs[mNetwork.StationAt(t.station_).lp_]->Receive(t);
         }
+        outbox.clear();
     }
+}
 
-    // Schedule the next arrival of B1/B2 event.
-    double interval;
-    if (event->type_ == B1) {
-        !nFlag
-            ? interval = gpRandomStream->Exponential(gPxInterArrivalTime)
-            : interval = gPxInterArrivalTime;
-    } else if (event->type_ == B2) {
-        !nFlag
-            ? interval = gpRandomStream->Exponential(gPyInterArrivalTime)
-            : interval = gPyInterArrivalTime;
+// Return the time of the imminent event of all LPs, and its LP
+double ParallelSimulation::Next (size_t& lp) const {
+    double next = HUGE_VAL;
+    for (size_t i = 0; i < mLPs.size(); i++) {
+        const Event* p = mLPs[i]->scheduler_.Peek();
+        if (p != NULL && p->time_ < next) {
+            next = p->time_;
+            lp = i;
+        }
     }
+    return next;
+}
 
-    gScheduler.Schedule(&gArrivalHandler, new Event(event->type_,
-                                                gSimulationTime + interval));
+// Return the LBTS, no packet passed between LPs is earlier
+double ParallelSimulation::Bound (double next) const {
+    double bound = HUGE_VAL;
+    for (size_t k = 0; k < mCross.size(); k++) {
+        int j = mCross[k];
+        const Station& station =
+                mLPs[mNetwork.StationAt(j).lp_]->network_.StationAt(j);
+        // A packet arriving next leaves after its service at least;
+        // with every server busy, only after the first departure
+        double out = next + station.serviceTime_.Min();
+        if (station.service_.State() == BUSY) {
+            out = (station.discipline_ != Station::PS
+                   && station.serving_.size() >= (size_t) station.servers_)
+                ? station.departure_ : std::min(out, station.departure_);
+        }
+        bound = std::min(bound, out);
+    }
+    return bound;
+}
 
-    gLastEventTime = gSimulationTime; // Update time of last event
+// Run the windows of LP i
+void ParallelSimulation::Worker (size_t i) {
+    for (;;) {
+        mBarrier.Wait(); // window opens
+        if (mDone) {
+            return;
+        }
+        mLPs[i]->RunUntil(mBound, mEndTime);
+        mBarrier.Wait(); // window closes
+    }
 }
 
-//---------------------------------------------------------------------------
-// Report performance metrics for the simulation
-//---------------------------------------------------------------------------
+// Run until endtime. The main thread runs LP 0 and the windows.
+void ParallelSimulation::Run (double endtime) {
+    mEndTime = endtime;
+    for (size_t i = 0; i < mLPs.size(); i++) {
+        mLPs[i]->Start();
+    }
+
+    vector<std::thread> threads;
+    for (size_t i = 1; i < mLPs.size(); i++) {
+        threads.push_back(std::thread(&ParallelSimulation::Worker, this, i));
+    }
 
-void Stats::Report () {
-    // Compute R mean service time
-    if (gpRouter->TotalPacket() > 0) {
-        mRMeanServiceTime =
-                     gpRouter->TotalServiceTime()/gpRouter->TotalPacket();
+    size_t lp = 0;
+    for (;;) {
+        Deliver();
+        double next = Next(lp);
+        if (next >= mEndTime) {
+            mDone = true;
+        } else {
+            mBound = Bound(next);
+        }
+        mBarrier.Wait(); // window opens
+        if (mDone) {
+            break;
+        }
+        mLPs[0]->RunUntil(mBound, mEndTime);
+        mBarrier.Wait(); // window closes
+        mWindows++;
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
     }
 
-    // Compute S1 mean service time
-    if (gpS1->TotalPacket() > 0) {
-        mS1MeanServiceTime = gpS1->TotalServiceTime()/gpS1->TotalPacket();
+    // Like the sequential run, end with the first event at or past endtime,
+    // or with the last event if the trace sources ran out first
+    if (Next(lp) < HUGE_VAL) {
+        mLPs[lp]->Step();
+        mTime = mLPs[lp]->time_;
+    } else {
+        for (size_t i = 0; i < mLPs.size(); i++) {
+            mTime = std::max(mTime, mLPs[i]->time_);
+        }
     }
+}
 
-    // Compute S2 mean service time
-    if (gpS2->TotalPacket() > 0) {
-        mS2MeanServiceTime = gpS2->TotalServiceTime()/gpS2->TotalPacket();
+// Report performance metrics, gathering every station from its LP
+void ParallelSimulation::Report () {
+    Network network = mNetwork;
+    Stats stats(network.Classes());
+    for (size_t j = 0; j < network.Stations(); j++) {
+        network.StationAt(j) =
+                mLPs[network.StationAt(j).lp_]->network_.StationAt(j);
     }
+    for (size_t i = 0; i < mLPs.size(); i++) {
+        stats.Merge(mLPs[i]->stats_);
+    }
+
+    vector<Metric> metrics;
+    CollectMetrics(mTime, network, stats, metrics);
+    ostream null(NULL);
+    Tee tee(cout, null);
+    ReportMetrics(tee, network, metrics);
 
     if (dFlag) {
-        gTee << "\n"
-             << "========================================================="
-             << "\n\n";
+        cout << "Logical processes: " << mLPs.size() << ", windows: "
+             << mWindows << "\n";
     }
+}
 
-    gTee << "Performance metrics for the simulation:\n"
-         << "========================================================="
-         << "\n\n"
-         << "Total simulated time = " << gSimulationTime << " sec\n"
-         << "Mean interarrival time for Px = "
-         << mMeanPxInterArrivalTime << " sec\n"
-         << "Mean interarrival time for Py = "
-         << mMeanPyInterArrivalTime << " sec\n";
+//---------------------------------------------------------------------------
+// Rare events
+//---------------------------------------------------------------------------
+
+// Estimates gamma, the probability that the packets at a station reach a
+// level L in a busy period, before the station empties, by fixed-effort
+// multilevel splitting (Garvels, 2000), the run being cloned whenever the
+// queue first crosses the levels 2, 3, ..., L in between. The first stage
+// is the run itself, saving the states where a packet arrives at the
+// empty station. Stage k then runs effort trajectories from the states
+// saved at level k, in turn, each until the station reaches k + 1,
+// saving its state for the next stage, or empties: the fraction reaching
+// k + 1 estimates P(k + 1 | k), and gamma is the product of them. A state
+// is cloned by saving it as a checkpoint, in memory, and loading it back;
+// every trajectory then draws from new substreams. Taking the stages as
+// independent, the relative error of gamma is sqrt(sum over the stages
+// of (1 - p) / (effort p)).
+class Splitting {
+public:
+    Splitting (const Network&, const string&, uint64_t, int, int, size_t);
+    bool Run (double, string&);
+    void Report (ostream&) const;
 
-    if (dFlag > 1) {
-        gTee << "R (Router):\n"
-             << "Total Px served by R = " << mTotalPxOnR
-             << ", "
-             << "Total Py served by R = " << mTotalPyOnR
-             << "\n";
+private:
+    Simulation mSim;
+    RandomStream mStream; // seeds the trajectories
+    int mStation;
+    int mLevel; // L
+    size_t mEffort; // trajectories per stage
+    double mBusy; // busy periods per second in the first stage
+    double mCycle; // events per busy period in the first stage
+    vector<double> mProbabilities; // of reaching the next level per stage
+    size_t mEvents; // events run in all
+    size_t mUnfinished; // trajectories stopped at the time limit
+
+    int Queue () {
+        return mSim.network_.StationAt(mStation).queue_.QueueSize();
     }
+    int Trajectory (int, double);
+};
+
+// Constructor, for level L at station j, with effort trajectories per
+// stage. The trajectories draw from the stream of replication 1.
+Splitting::Splitting (const Network& network, const string& fel,
+                      uint64_t seed, int j, int level, size_t effort)
+    : mSim(network, fel, seed, 0, false), mStream(seed), mStation(j),
+      mLevel(level), mEffort(effort), mBusy(0), mCycle(0), mEvents(0),
+      mUnfinished(0) {
+    mStream.LongJump();
+}
 
-    gTee << "Mean service time for R = "<<mRMeanServiceTime <<" sec\n";
+// Run a trajectory until the station has high packets (returns 1) or
+// none (returns -1), or for limit seconds at most (returns 0)
+int Splitting::Trajectory (int high, double limit) {
+    double end = mSim.time_ + limit;
+    while (mSim.Step()) {
+        mEvents++;
+        int size = Queue();
+        if (size >= high) {
+            return 1;
+        }
+        if (size == 0) {
+            return -1;
+        }
+        if (mSim.time_ >= end) {
+            mUnfinished++;
+            return 0;
+        }
+    }
+    return 0;
+}
 
-    if (dFlag > 1) {
-         gTee << "S1 (Server 1):\n"
-              << "\n";
+// Run the stages, the first one and every trajectory for limit seconds
+// at most. On error returns false with a message in error.
+bool Splitting::Run (double limit, string& error) {
+    vector<string> states, next;
+    mSim.Start();
+    int size = Queue();
+    while (states.size() < mEffort && mSim.time_ < limit && mSim.Step()) {
+        mEvents++;
+        if (size == 0 && Queue() > 0) {
+            std::ostringstream out;
+            mSim.Save(out);
+            states.push_back(out.str());
+        }
+        size = Queue();
+    }
+    if (states.empty()) {
+        error = "no busy period of station "
+              + mSim.network_.StationAt(mStation).name_;
+        return false;
+    }
+    mBusy = states.size() / mSim.time_;
+    mCycle = (double) mEvents / states.size();
+
+    for (int level = 1; level < mLevel && !states.empty(); level++) {
+        next.clear();
+        for (size_t n = 0; n < mEffort; n++) {
+            istringstream in(states[n % states.size()]);
+            mSim.Load(in);
+            mSim.Seed(RandomStream((uint64_t) (mStream.Uniform()
+                                               * 9007199254740992.0)));
+            if (Queue() >= level + 1 || Trajectory(level + 1, limit) > 0) {
+                std::ostringstream out;
+                mSim.Save(out);
+                next.push_back(out.str());
+            }
+        }
+        mProbabilities.push_back((double) next.size() / mEffort);
+        states.swap(next);
     }
+    return true;
+}
 
-    gTee << "Total Px served by S1 = " <<gpS1->TotalPacket()<<"\n"
-         << "Mean service time for S1 = " <<mS1MeanServiceTime<<" sec\n";
+// Report the estimate of gamma with its relative error, and what a run
+// without splitting would need for the same error
+void Splitting::Report (ostream& out) const {
+    const Station& station = mSim.network_.StationAt(mStation);
+    double gamma = 1, error = 0;
+    for (size_t k = 0; k < mProbabilities.size(); k++) {
+        gamma *= mProbabilities[k];
+        error += (1 - mProbabilities[k]) / (mEffort * mProbabilities[k]);
+    }
+    error = sqrt(error);
 
-    if (dFlag > 1) {
-         gTee << "S2 (Server 2):\n"
-              << "\n";
+    out << "Overflow probability by multilevel splitting:\n"
+        << "========================================================="
+        << "\n\n";
+    if (dFlag) {
+        for (size_t k = 0; k < mProbabilities.size(); k++) {
+            out << "P(" << k + 2 << " | " << k + 1 << ") = "
+                << mProbabilities[k] << "\n";
+        }
+    }
+    out << "Busy periods of " << station.name_ << " per second = " << mBusy
+        << "\n"
+        << "Probability of " << mLevel << " packets at " << station.name_
+        << " in a busy period = " << gamma << "\n";
+    if (gamma > 0) {
+        out << "Relative error = " << 100 * error << " %\n"
+            << "95% confidence interval = " << gamma * (1 - 1.96 * error)
+            << " to " << gamma * (1 + 1.96 * error) << "\n"
+            << "Overflows per second = " << gamma * mBusy << "\n";
+    }
+    out << "Trajectories per level = " << mEffort << "\n"
+        << "Events run = " << mEvents << "\n";
+    if (gamma > 0 && error > 0) {
+        // Busy periods for the same relative error, each of mCycle events
+        out << "Events without splitting for the same error = "
+            << (1 - gamma) / (gamma * error * error) * mCycle << "\n";
     }
-    gTee << "Total Py served by S2 = " <<gpS2->TotalPacket()<<"\n"
-         << "Mean service time for S2 = " <<mS2MeanServiceTime<<" sec\n\n";
+    if (mUnfinished > 0) {
+        out << "Trajectories stopped at -t = " << mUnfinished << "\n";
+    }
+    out << "\n";
 }
 
+#ifndef SIM_BENCH
+
 //---------------------------------------------------------------------------
 // Main program
 //---------------------------------------------------------------------------
 
+// Return the banner printed before the run: the network diagram, or the
+// size of the topology read from file
+string Banner (const Network& network, const string& topology) {
+    if (topology.empty()) {
+        return DIAGRAM;
+    }
+    std::ostringstream oss;
+    oss << "\n"
+        << "=========================================================\n"
+        << "    Network System Simulation: " << topology << "\n"
+        << "    " << network.Sources() << " sources, "
+        << network.Stations() << " stations, "
+        << network.Classes() << " packet classes\n"
+        << "=========================================================\n";
+    return oss.str();
+}
+
 int main (int argc, char* argv[]) {
     int option = 0;
     string optargstr; // argument option in string
     double endtime = 0; // simulation ending time
     size_t endpx = 0; // simulation ending packet count
     long endpxx = 0;
+    string felName = "heap"; // future event list chosen with -q
+    FutureEventList* fel;
+    string topology; // topology file given with -f
+    string error;
+    long replications = 1; // number of replications (-r)
+    long threads = std::thread::hardware_concurrency(); // threads (-j)
+    long seedl = time(NULL); // seed of the first replication (-s)
+    long lps = 1; // logical processes of a parallel run (-p)
+    double precision = 0; // relative half width ending the run (-e)
+    vector<Variable> variables; // variables of a sweep (-v)
+    bool engineStats = false; // report the engine counters
+    double checkpoint = 0; // simulated time between checkpoints
+    string resume; // checkpoint to resume from
+    double hybrid = 0; // utilization below which a station is analytic
+    double sample = 0; // simulated time between samples
+    string overflow; // station:level of the splitting
+    long effort = 1000; // trajectories per level of the splitting
+    bool antithetic = false; // replications in antithetic pairs
+    bool paired = false; // sweep reported as differences from the first
+    const struct option longOptions[] = {
+        { "engine-stats", no_argument, NULL, 'E' },
+        { "checkpoint", required_argument, NULL, 'K' },
+        { "resume", required_argument, NULL, 'R' },
+        { "hybrid", required_argument, NULL, 'H' },
+        { "sample", required_argument, NULL, 'S' },
+        { "overflow", required_argument, NULL, 'O' },
+        { "effort", required_argument, NULL, 'F' },
+        { "antithetic", no_argument, NULL, 'A' },
+        { "paired", no_argument, NULL, 'P' },
+        { NULL, 0, NULL, 0 }
+    };
 
     // Read the parameters
-    while ((option = getopt(argc, argv, "ndht:x:")) != -1) {
+    while ((option = getopt_long(argc, argv, "ndhwt:x:q:f:r:j:s:p:c:e:v:",
+                                 longOptions, NULL)) != -1) {
         switch (option) {
         case 'h':
             cout << DIAGRAM;
@@ -881,9 +4991,52 @@ int main (int argc, char* argv[]) {
                  << "Options:\n"
                  << "\t-n : do not use random number stream generation\n"
                  << "\t-t : simulation ending time (default 200 s)\n"
-                 << "\t-x : simulation ending packet count\n"
-                 << "\t-d : increase debugging verbosity (-dd even more)\n"
-                 << "\t-h : show this help and exit\n\n";
+                 << "\t-x : simulation ending packet count "
+                 << "(of the first packet class)\n"
+                 << "\t-f : network topology file (default the diagram)\n"
+                 << "\t-r : number of independent replications (default 1)\n"
+                 << "\t-j : threads running the replications "
+                 << "(default all cores)\n"
+                 << "\t-s : random number seed (default the time)\n"
+                 << "\t-p : logical processes of a parallel run "
+                 << "(needs -t)\n"
+                 << "\t-w : delete the warm-up detected by MSER-5\n"
+                 << "\t-e : end when the relative half width of the batch "
+                 << "means is below\n\t     this (e.g. 0.05)\n"
+                 << "\t-v : sweep variable $name of the topology, "
+                 << "name=first:last:step or\n\t     name=value,value,... "
+                 << "(repeat for more variables)\n"
+                 << "\t-c : convert a binary trace (output2.bin) to CSV "
+                 << "on standard output and exit\n"
+                 << "\t-d : increase debugging verbosity (-dd even more), "
+                 << "the event\n\t     trace in SimDebug only\n"
+                 << "\t-q : future event list, heap (default) or calendar\n"
+                 << "\t-h : show this help and exit\n"
+                 << "\t--engine-stats : report events, events per second, "
+                 << "FEL size, heap\n\t     allocations and time per "
+                 << "event type of a single run\n"
+                 << "\t--checkpoint : write checkpoint.bin every this "
+                 << "many seconds of\n\t     simulated time\n"
+                 << "\t--resume : continue the run saved in a checkpoint "
+                 << "file\n"
+                 << "\t--hybrid : serve by a queueing model the stations "
+                 << "offered less than\n\t     this utilization "
+                 << "(e.g. 0.3), and report its error\n"
+                 << "\t--sample : write the queue, busy servers and "
+                 << "throughput of every\n\t     station every this many "
+                 << "seconds of simulated time to\n\t     samples.csv\n"
+                 << "\t--overflow : estimate the probability that the "
+                 << "packets at a station\n\t     reach a level in a busy "
+                 << "period, station:level, by\n\t     multilevel "
+                 << "splitting (-t bounds every stage)\n"
+                 << "\t--effort : trajectories per level of the splitting "
+                 << "(default 1000)\n"
+                 << "\t--antithetic : run the replications in pairs, the "
+                 << "second of each on\n\t     1 - u for every random "
+                 << "number u of the first (-r even)\n"
+                 << "\t--paired : report a sweep as the differences from "
+                 << "the first\n\t     configuration, with paired "
+                 << "confidence intervals (needs -r)\n\n";
               return(EXIT_SUCCESS);
         case 't':
             optargstr = optarg;
@@ -910,8 +5063,109 @@ int main (int argc, char* argv[]) {
             }
             xFlag++;
             break;
+        case 'q':
+            optargstr = optarg;
+            if ((fel = NewFEL(optargstr)) == NULL) {
+                cout << argv[0] << ": invalid argument -- '"
+                     << optargstr <<"'\n";
+                goto help;
+            }
+            delete fel;
+            felName = optargstr;
+            break;
+        case 'f':
+            topology = optarg;
+            break;
+        case 'v':
+            optargstr = optarg;
+            variables.push_back(Variable());
+            if (!variables.back().Parse(optargstr)) {
+                cout << argv[0] << ": invalid argument -- '"
+                     << optargstr <<"'\n";
+                goto help;
+            }
+            break;
+        case 'e': {
+            optargstr = optarg;
+            istringstream iss(optargstr);
+            if (!(iss >> precision) || precision <= 0) {
+                cout << argv[0] << ": invalid argument -- '"
+                     << optargstr <<"'\n";
+                goto help;
+            }
+            break;
+        }
+        case 'c':
+            if (!ConvertTrace(optarg, cout)) {
+                cout << argv[0] << ": " << optarg << ": not a trace\n";
+                return(EXIT_FAILURE);
+            }
+            return(EXIT_SUCCESS);
+        case 'r':
+        case 'j':
+        case 's':
+        case 'p': {
+            optargstr = optarg;
+            long& value = (option == 'r') ? replications
+                        : (option == 'j') ? threads
+                        : (option == 'p') ? lps : seedl;
+            istringstream iss(optargstr);
+            if (!(iss >> value) || value < (option == 's' ? 0 : 1)) {
+                cout << argv[0] << ": invalid argument -- '"
+                     << optargstr <<"'\n";
+                goto help;
+            }
+            break;
+        }
         case 'd': dFlag++; break;
         case 'n': nFlag++; break;
+        case 'w': wFlag++; break;
+        case 'E': engineStats = true; break;
+        case 'A': antithetic = true; break;
+        case 'P': paired = true; break;
+        case 'K': {
+            optargstr = optarg;
+            istringstream iss(optargstr);
+            if (!(iss >> checkpoint) || checkpoint <= 0) {
+                cout << argv[0] << ": invalid argument -- '"
+                     << optargstr <<"'\n";
+                goto help;
+            }
+            break;
+        }
+        case 'R': resume = optarg; break;
+        case 'H': {
+            optargstr = optarg;
+            istringstream iss(optargstr);
+            if (!(iss >> hybrid) || hybrid <= 0 || hybrid > 1) {
+                cout << argv[0] << ": invalid argument -- '"
+                     << optargstr <<"'\n";
+                goto help;
+            }
+            hFlag++;
+            break;
+        }
+        case 'O': overflow = optarg; break;
+        case 'F': {
+            optargstr = optarg;
+            istringstream iss(optargstr);
+            if (!(iss >> effort) || effort < 1) {
+                cout << argv[0] << ": invalid argument -- '"
+                     << optargstr <<"'\n";
+                goto help;
+            }
+            break;
+        }
+        case 'S': {
+            optargstr = optarg;
+            istringstream iss(optargstr);
+            if (!(iss >> sample) || sample <= 0) {
+                cout << argv[0] << ": invalid argument -- '"
+                     << optargstr <<"'\n";
+                goto help;
+            }
+            break;
+        }
 help:
         default :
                   cout << "Try `" << argv[0]
@@ -923,6 +5177,44 @@ help:
     //XXX
     if (tFlag && xFlag) {
         goto help;
+    } else if (lps > 1 && (!tFlag || replications > 1)) {
+        // A parallel run cannot see a packet count, nor be replicated
+        goto help;
+    } else if ((wFlag || precision > 0) && lps > 1) {
+        // Nor delete its warm-up
+        goto help;
+    } else if (precision > 0 && (replications > 1 || !variables.empty())) {
+        // Every replication would end at its own time
+        goto help;
+    } else if (!variables.empty() && lps > 1) {
+        goto help;
+    } else if (hFlag && lps > 1) {
+        // The model passes packets on ahead of the time of the run
+        goto help;
+    } else if (antithetic && replications % 2) {
+        // The replications run in pairs
+        goto help;
+    } else if (paired && (variables.empty() || replications < 2)) {
+        // Differences between configurations, replication by replication
+        goto help;
+    } else if (!overflow.empty()
+                && (xFlag || wFlag || precision > 0 || hFlag || lps > 1
+                    || replications > 1 || !variables.empty() || engineStats
+                    || checkpoint > 0 || !resume.empty() || sample > 0)) {
+        // The splitting runs stages of its own
+        goto help;
+    } else if (!overflow.empty() && !tFlag) {
+        // No time limit on the stages
+        endtime = HUGE_VAL;
+    } else if ((engineStats || checkpoint > 0 || !resume.empty()
+                || sample > 0)
+                && (lps > 1 || replications > 1 || !variables.empty())) {
+        // The counters, checkpoints and samples are those of a single run
+        goto help;
+    } else if (precision > 0 && !tFlag && !xFlag) {
+        // No limit but the precision
+        endtime = HUGE_VAL;
+        endpx = static_cast<size_t>(-1);
     } else if (!tFlag && !xFlag) {
         // Default values
         endtime = 200;
@@ -932,113 +5224,273 @@ help:
     if (dFlag) {
         cout << "endtime: " << endtime <<"\n";
         cout << "endpx: " << endpx <<"\n";
+        if (!nFlag) {
+            cout << "seed: " << seedl <<"\n";
+        }
+        if (!TRACING) {
+            cout << "event trace: not in this build, see make debug\n";
+        }
+    }
+
+    // Build the network
+    string text = DEFAULT_TOPOLOGY;
+    if (!topology.empty()) {
+        std::ifstream in(topology.c_str());
+        if (!in) {
+            cout << argv[0] << ": cannot open '" << topology << "'\n";
+            return(EXIT_FAILURE);
+        }
+        std::ostringstream oss;
+        oss << in.rdbuf();
+        text = oss.str();
+    }
+
+    if (!variables.empty()) {
+        // Sweep, one network per configuration, reported as a table
+        vector<Network> networks;
+        vector<vector<double> > values;
+        vector<string> names;
+        if (!LoadSweep(text, variables, networks, values, error)) {
+            cout << argv[0] << ": " << (topology.empty() ? "" : topology + ": ")
+                 << error << "\n";
+            return(EXIT_FAILURE);
+        }
+        for (size_t v = 0; v < variables.size(); v++) {
+            names.push_back(variables[v].name_);
+        }
+        for (size_t i = 0; hFlag && i < networks.size(); i++) {
+            networks[i].Hybrid(hybrid);
+        }
+        Replications runs(networks, felName, seedl, replications,
+                          antithetic);
+        runs.Run(threads, endtime, endpx);
+        runs.Table(cout, names, values, paired);
+        return(EXIT_SUCCESS);
+    }
+
+    Network network;
+    istringstream iss(text);
+    if (!network.Load(iss, error)) {
+        cout << argv[0] << ": " << topology << ": " << error << "\n";
+        return(EXIT_FAILURE);
+    }
+    if (!overflow.empty()) {
+        // Overflow probability by splitting, silent like the replications
+        size_t colon = overflow.rfind(':');
+        int j = network.FindStation(overflow.substr(0, colon));
+        long level = 0;
+        istringstream iss(colon == string::npos ? ""
+                                                : overflow.substr(colon + 1));
+        if (j < 0 || !(iss >> level) || level < 2) {
+            cout << argv[0] << ": invalid argument -- '" << overflow
+                 << "'\n";
+            goto help;
+        }
+        cout << Banner(network, topology);
+        Splitting split(network, felName, seedl, j, level, effort);
+        if (!split.Run(endtime, error)) {
+            cout << argv[0] << ": " << error << "\n";
+            return(EXIT_FAILURE);
+        }
+        split.Report(cout);
+        return(EXIT_SUCCESS);
+    }
+    if (hFlag) {
+        size_t analytic = network.Hybrid(hybrid);
+        if (dFlag) {
+            cout << "analytic stations: " << analytic << "\n";
+        }
+    }
+
+    if (lps > 1) {
+        // Parallel run, silent like the replications. A blocked station
+        // would have to wait for the queue of another logical process.
+        if (network.Blocking()) {
+            cout << argv[0] << ": " << topology
+                 << ": blocking queues need a single logical process\n";
+            return(EXIT_FAILURE);
+        }
+        cout << Banner(network, topology);
+        ParallelSimulation run(network, felName, seedl, lps);
+        run.Run(endtime);
+        run.Report();
+        return(EXIT_SUCCESS);
+    }
+
+    if (replications > 1) {
+        // Replications run silently, only their summary is reported
+        cout << Banner(network, topology);
+        vector<Network> networks(1, network);
+        Replications runs(networks, felName, seedl, replications,
+                          antithetic);
+        runs.Run(threads, endtime, endpx);
+        runs.Report();
+        return(EXIT_SUCCESS);
     }
 
     // Initialization
-    gOutfile1.open("output1.txt");
-    gOutfile2.open("output2.txt");
-    gSimulationTime = 0;
-    gLastEventTime = 0;
-    gPxInterArrivalTime = 5;
-    gPyInterArrivalTime = 10;
-    gRouterServiceTime = 1;
-    gS1ServiceTime = 4;
-    gS2ServiceTime = 7;
-    gSigma = 0.6;
-    gSigma1 = 0.6;
-    gSigma2 = 0.6;
-    gpRouter = new Service;
-    gpS1 = new Service;
-    gpS2 = new Service;
-    gpRouterQueue = new PacketQueue;
-    gpS1Queue = new PacketQueue;
-    gpS2Queue = new PacketQueue;
-    gpStats = new Stats;
-
-    if (!nFlag) {
-        // Initialize the psuedo random number generator
-        //long seed = 2;
-        //srandom(seed); // set the seed value
-        srandom(time(NULL));
-        gpRandomStream = new RandomStream;
-    }
-    // Prints the network diagram
-    gTee << DIAGRAM;
-
-    // Write header to output file 2
-    gOutfile2 << "router,no,type,arrival,begin,service time,"
-              << "end,wait in q,spend,idle \\ \n"
-              << "  server type,no,type,arrival,begin,service time,"
-              << "end,wait in q,spend,idle\n";
+    Simulation sim(network, felName, seedl, 0, true);
+    sim.precision_ = precision;
+    EngineStats engine;
+    if (engineStats) {
+        sim.engine_ = &engine;
+    }
+    sim.checkpoint_ = checkpoint;
+    sim.nextCheckpoint_ = checkpoint;
+    if (!resume.empty() && !sim.Load(resume, error)) {
+        cout << argv[0] << ": " << resume << ": " << error << "\n";
+        return(EXIT_FAILURE);
+    }
+    if (sample > 0) {
+        // Room for the samples up to -t, then as many as needed
+        sim.Sample(sample, tFlag ? (size_t) (endtime / sample) + 1 : 0);
+    }
 
-    if (dFlag) {
-        gTee << "\n" << gSimulationTime << " (initialize simulation) ";
+    // Prints the network diagram, or the topology file read
+    sim.tee_ << Banner(network, topology);
+
+    sim.Run(endtime, endpx);
+    sim.Report();
+    if (engineStats) {
+        engine.Report(cout);
     }
 
-    // Put initial events in FEL
-    double interval;
-    !nFlag
-        ? interval = gpRandomStream->Exponential(gPxInterArrivalTime)
-        : interval = gPxInterArrivalTime;
+//XXX
+//#if defined(_WIN32) || defined(_WIN64)
+//    cout << "\nPress enter to exit...\n";
+//    std::cin.get();
+//#endif
+    return(EXIT_SUCCESS);
+}
+
+#else // SIM_BENCH
 
-    gScheduler.Schedule(&gArrivalHandler,
-                                  new Event(B1, gSimulationTime + interval));
-    !nFlag
-        ? interval = gpRandomStream->Exponential(gPyInterArrivalTime)
-        : interval = gPyInterArrivalTime;
+//---------------------------------------------------------------------------
+// FEL benchmark (make bench)
+//---------------------------------------------------------------------------
 
-    gScheduler.Schedule(&gArrivalHandler,
-                                  new Event(B2, gSimulationTime + interval));
+// Hold model: fill the FEL with n events, then repeatedly remove the
+// imminent event and schedule a new one at its time plus an increment,
+// so the FEL size stays at n. Returns nanoseconds per hold, and the heap
+// allocations per hold in allocations.
+double Hold (const string& name, size_t n, size_t holds,
+             const vector<double>& increments, double& allocations) {
+    Scheduler scheduler;
+    scheduler.UseFEL(NewFEL(name));
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++) {
+        scheduler.Schedule(0, 0, increments[k++ % increments.size()]);
+    }
 
-    while (1) {
-        // Remove the imminent B-event from FEL
-        Event* p = gScheduler.Deque();
+    size_t allocated = tAllocations;
+    clock_t start = clock();
+    Event e;
+    for (size_t i = 0; i < holds; i++) {
+        scheduler.Deque(e);
+        scheduler.Schedule(0, 0, e.time_ + increments[k++ % increments.size()]);
+    }
+    clock_t end = clock();
+    allocations = (double) (tAllocations - allocated) / holds;
+    return (double)(end - start) / CLOCKS_PER_SEC * 1e9 / holds;
+}
 
-        // Advance simulation clock to its event time
-        gSimulationTime = p->time_;
-        if (dFlag) {
-            gTee << "\n" << gSimulationTime
-                 << " (Event B" << p->type_ << ") ";
+// Increments of the hold model workloads, all of mean about 1:
+// exponential, uniform on [0, 2), and bimodal, 90% on [0, 0.2) and 10%
+// on [9, 11), which defeats FELs tuned to an even event spacing
+void Increments (const string& name, vector<double>& increments) {
+    RandomStream stream(1);
+    for (size_t i = 0; i < increments.size(); i++) {
+        double u = stream.Uniform();
+        if (name == "exponential") {
+            increments[i] = -log(u);
+        } else if (name == "uniform") {
+            increments[i] = 2 * u;
+        } else if (u < 0.9) {
+            increments[i] = 0.2 * stream.Uniform();
+        } else {
+            increments[i] = 9 + 2 * stream.Uniform();
         }
+    }
+}
 
-        // Execute all B-type events that were removed from the FEL
-        gScheduler.Dispatch(p);
+// Time n variates drawn one at a time and in batches of the buffer
+// size. Returns nanoseconds per variate, scalar and batched.
+void Variates (const string& name, size_t n, vector<double>& buffer,
+               double& scalar, double& batched) {
+    RandomStream stream(1);
+    volatile double sink = 0;
+
+    clock_t start = clock();
+    for (size_t i = 0; i < n; i++) {
+        sink = (name == "exp") ? stream.Exponential(1.0)
+                               : stream.Normal(0.0, 1.0);
+    }
+    clock_t end = clock();
+    scalar = (double)(end - start) / CLOCKS_PER_SEC * 1e9 / n;
 
-        if (tFlag) {
-            if (gSimulationTime >= endtime) {
-                break;
-            }
-        } else if (xFlag) {
-            if (gpS1->TotalPacket() == endpx) {
-                break;
-            }
+    start = clock();
+    for (size_t i = 0; i < n; i += buffer.size()) {
+        if (name == "exp") {
+            stream.Exponentials(&buffer[0], buffer.size(), 1.0);
         } else {
-            if (gSimulationTime >= endtime || gpS1->TotalPacket() == endpx) {
-                break;
-            }
+            stream.Normals(&buffer[0], buffer.size(), 0.0, 1.0);
         }
+        sink = buffer[0];
     }
+    end = clock();
+    batched = (double)(end - start) / CLOCKS_PER_SEC * 1e9 / n;
+    (void) sink;
+}
+
+int main () {
+    const char* fels[] = { "heap", "calendar" };
+    const size_t nfels = sizeof(fels) / sizeof(fels[0]);
+
+    const char* workloads[] = { "exponential", "uniform", "bimodal" };
+    const size_t nworkloads = sizeof(workloads) / sizeof(workloads[0]);
 
-    gTee << "\n";
-    gOutfile2 << "\n";
-    gpStats->Report();
+    for (size_t w = 0; w < nworkloads; w++) {
+        // Draw the increments up front so the timing covers the FEL only
+        vector<double> increments(1 << 16);
+        Increments(workloads[w], increments);
 
-    // Deallocation routines
-    if (!nFlag) {
-        delete gpRandomStream;
+        cout << (w ? "\n" : "") << "Hold model, " << workloads[w]
+             << " increments, ns and heap allocations per hold\n\n"
+             << "FEL size";
+        for (size_t f = 0; f < nfels; f++) {
+            cout << "\t" << fels[f];
+        }
+        for (size_t f = 0; f < nfels; f++) {
+            cout << "\t" << fels[f] << " allocs";
+        }
+        cout << "\n";
+
+        for (size_t n = 10; n <= 1000000; n *= 10) {
+            size_t holds = std::max((size_t) 1000000, 5 * n);
+            vector<double> allocations(nfels);
+            cout << n;
+            for (size_t f = 0; f < nfels; f++) {
+                cout << "\t" << Hold(fels[f], n, holds, increments,
+                                     allocations[f]);
+            }
+            for (size_t f = 0; f < nfels; f++) {
+                cout << "\t" << allocations[f];
+            }
+            cout << "\n";
+        }
     }
-    delete gpRouter;
-    delete gpS1;
-    delete gpS2;
-    delete gpRouterQueue;
-    delete gpS1Queue;
-    delete gpS2Queue;
-    delete gpStats;
 
-//XXX
-//#if defined(_WIN32) || defined(_WIN64)
-//    cout << "\nPress enter to exit...\n";
-//    std::cin.get();
-//#endif
+    const char* variates[] = { "exp", "normal" };
+    vector<double> buffer(256);
+    cout << "\nVariates, ns per variate, one at a time and in batches of "
+         << buffer.size() << "\n\n"
+         << "variate\tscalar\tbatched\n";
+    for (size_t v = 0; v < 2; v++) {
+        double scalar, batched;
+        Variates(variates[v], 10000000, buffer, scalar, batched);
+        cout << variates[v] << "\t" << scalar << "\t" << batched << "\n";
+    }
     return(EXIT_SUCCESS);
 }
+
+#endif // SIM_BENCH